@@ -28,16 +28,189 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <exception>
+#include <algorithm>
 
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 
 #include "FlowImage.h"
+#include "colorcode.h"
+#include "colorwheel.h"
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 using namespace std;
 
-void FlowImage::ReadFromFloFile(const char* file_path)
+int FlowImage::FloMaxDimension = 99999;
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag MatAccessFlag;
+#else
+typedef int MatAccessFlag;
+#endif
+
+// Owner of a memory-mapped .flo file.  UMatData::origdata/size describe the whole view,
+// UMatData::data points to the payload behind the 12-byte header.
+class MappedFloAllocator : public cv::MatAllocator
+{
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+        MatAccessFlag flags, cv::UMatUsageFlags usageFlags) const
+    {
+        // only used if a cv::Mat over the mapping is re-created with another shape
+        return cv::Mat::getDefaultAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+
+    bool allocate(cv::UMatData* u, MatAccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const
+    {
+        return cv::Mat::getDefaultAllocator()->allocate(u, accessFlags, usageFlags);
+    }
+
+    void deallocate(cv::UMatData* u) const
+    {
+        if (u == NULL || u->refcount != 0) { return; }
+#ifdef _WIN32
+        UnmapViewOfFile(u->origdata);
+#else
+        munmap(u->origdata, u->size);
+#endif
+        delete u;
+    }
+};
+
+static MappedFloAllocator MappedFloAllocatorInstance;
+
+// map a file copy-on-write, so that the cv::Mat can be modified without touching the file
+static void MapFloFile(const char* file_path, uchar*& base, size_t& length)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        throw CError("ReadFlowFile: could not open %s", file_path);
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < 12)
+    {
+        CloseHandle(file);
+        throw CError("ReadFlowFile: problem reading file %s", file_path);
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    base = mapping ? (uchar*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+    length = (size_t)size.QuadPart;
+    if (mapping) { CloseHandle(mapping); }
+    if (base == NULL)
+        throw CError("ReadFlowFile: could not map %s", file_path);
+#else
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
+        throw CError("ReadFlowFile: could not open %s", file_path);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12)
+    {
+        close(fd);
+        throw CError("ReadFlowFile: problem reading file %s", file_path);
+    }
+    length = (size_t)st.st_size;
+    void* view = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED)
+        throw CError("ReadFlowFile: could not map %s", file_path);
+    base = (uchar*)view;
+#endif
+}
+
+// check the header fields of a .flo file
+static void CheckFloHeader(float tag, int width, int height, const char* file_path)
+{
+    if (tag != TAG_FLOAT) // simple test for correct endian-ness
+        throw CError("ReadFlowFile(%s): wrong tag (possibly due to big-endian machine?)", file_path);
+
+    // another sanity check to see that integers were read correctly (99999 should do the trick...)
+    if (width < 1 || width > FlowImage::FloMaxDimension)
+        throw CError("ReadFlowFile(%s): illegal width %d", file_path, width);
+
+    if (height < 1 || height > FlowImage::FloMaxDimension)
+        throw CError("ReadFlowFile(%s): illegal height %d", file_path, height);
+}
+
+FlowImage::FloHeader FlowImage::ReadHeaderFromFloFile(const char* file_path)
+{
+    if (strcmp(file_path, "") == 0)
+        throw CError("ReadFlowHeader: empty file_path");
+
+    const char *dot = strrchr(file_path, '.');
+    if (dot == NULL || strcmp(dot, ".flo") != 0)
+        throw CError("ReadFlowHeader (%s): extension .flo expected", file_path);
+
+    FILE* stream = fopen(file_path, "rb");
+    if (stream == 0)
+        throw CError("ReadFlowHeader: could not open %s", file_path);
+
+    int width, height;
+    float tag;
+
+    if ((int)fread(&tag, sizeof(float), 1, stream) != 1 ||
+        (int)fread(&width, sizeof(int), 1, stream) != 1 ||
+        (int)fread(&height, sizeof(int), 1, stream) != 1)
+    {
+        fclose(stream);
+        throw CError("ReadFlowHeader: problem reading file %s", file_path);
+    }
+#ifdef _WIN32
+    struct _stat64 st;
+    bool has_size = _fstat64(_fileno(stream), &st) == 0;
+#else
+    struct stat st;
+    bool has_size = fstat(fileno(stream), &st) == 0;
+#endif
+    size_t file_bytes = has_size ? (size_t)st.st_size : 0;
+    fclose(stream);
+
+    CheckFloHeader(tag, width, height, file_path);
+
+    FloHeader header;
+    header.width = width;
+    header.height = height;
+    header.bytes = 12 + (size_t)2 * width * height * sizeof(float);
+    header.valid = true;
+
+    if (file_bytes < header.bytes)
+        throw CError("ReadFlowHeader(%s): file is too short", file_path);
+    if (file_bytes > header.bytes)
+        throw CError("ReadFlowHeader(%s): file is too long", file_path);
+
+    return header;
+}
+
+void FlowImage::ReadHeadersFromFloFiles(const std::vector<std::string>& file_paths, std::vector<FloHeader>& headers)
+{
+    headers.resize(file_paths.size());
+    for (size_t i = 0; i < file_paths.size(); i++)
+    {
+        try
+        {
+            headers[i] = ReadHeaderFromFloFile(file_paths[i].c_str());
+        }
+        catch (CError&)
+        {
+            headers[i].width = headers[i].height = 0;
+            headers[i].bytes = 0;
+            headers[i].valid = false;
+        }
+    }
+}
+
+// read a .flo file into flow_mat, optionally accumulating statistics per row
+static void ReadFloFile(cv::Mat& flow_mat, const char* file_path, CFlowStats* stats)
 {
     if (strcmp(file_path, "") == 0)
         throw CError("ReadFlowFile: empty file_path");
@@ -58,23 +231,31 @@ void FlowImage::ReadFromFloFile(const char* file_path)
         (int)fread(&height, sizeof(int), 1, stream) != 1)
         throw CError("ReadFlowFile: problem reading file %s", file_path);
 
-    if (tag != TAG_FLOAT) // simple test for correct endian-ness
-        throw CError("ReadFlowFile(%s): wrong tag (possibly due to big-endian machine?)", file_path);
-
-    // another sanity check to see that integers were read correctly (99999 should do the trick...)
-    if (width < 1 || width > 99999)
-        throw CError("ReadFlowFile(%s): illegal width %d", file_path, width);
-
-    if (height < 1 || height > 99999)
-        throw CError("ReadFlowFile(%s): illegal height %d", file_path, height);
+    CheckFloHeader(tag, width, height, file_path);
 
     int nBands = 2;
-    FlowMatF32C2 = cv::Mat(height, width, CV_32FC2);
+    flow_mat = cv::Mat(height, width, CV_32FC2);
 
     //printf("reading %d x %d x 2 = %d floats\n", width, height, width*height*2);
-    int n = nBands * width * height;
-    if ((int)fread(FlowMatF32C2.data, sizeof(float), n, stream) != n)
-        throw CError("ReadFlowFile(%s): file is too short", file_path);
+    if (stats == NULL)
+    {
+        size_t n = (size_t)nBands * width * height;
+        if (fread(flow_mat.data, sizeof(float), n, stream) != n)
+            throw CError("ReadFlowFile(%s): file is too short", file_path);
+    }
+    else
+    {
+        stats->Clear();
+        int n = nBands * width;
+        for (int y = 0; y < height; y++)
+        {
+            float* flow_row_ptr = ((float*)flow_mat.data) + (size_t)n * y;
+            if ((int)fread(flow_row_ptr, sizeof(float), n, stream) != n)
+                throw CError("ReadFlowFile(%s): file is too short", file_path);
+            // the row is still in cache
+            stats->AddRow(flow_row_ptr, width);
+        }
+    }
 
     if (fgetc(stream) != EOF)
         throw CError("ReadFlowFile(%s): file is too long", file_path);
@@ -82,6 +263,60 @@ void FlowImage::ReadFromFloFile(const char* file_path)
     fclose(stream);
 }
 
+void FlowImage::ReadFromFloFile(const char* file_path)
+{
+    ReadFloFile(FlowMatF32C2, file_path, NULL);
+}
+
+void FlowImage::ReadFromFloFile(const char* file_path, CFlowStats& stats)
+{
+    ReadFloFile(FlowMatF32C2, file_path, &stats);
+}
+
+void FlowImage::ReadFromFloFileMapped(const char* file_path)
+{
+    if (strcmp(file_path, "") == 0)
+        throw CError("ReadFlowFile: empty file_path");
+
+    const char *dot = strrchr(file_path, '.');
+    if (dot == NULL || strcmp(dot, ".flo") != 0)
+        throw CError("ReadFlowFile (%s): extension .flo expected", file_path);
+
+    uchar* base;
+    size_t length;
+    MapFloFile(file_path, base, length);
+
+    // the UMatData owns the view from here on, so every error path below unmaps it
+    cv::UMatData* u = new cv::UMatData(&MappedFloAllocatorInstance);
+    u->origdata = base;
+    u->data = base + 12;
+    u->size = length;
+    cv::Mat mapped_mat;
+    mapped_mat.u = u;
+    mapped_mat.addref();
+
+    int width, height;
+    float tag;
+    memcpy(&tag, base + 0, sizeof(float));
+    memcpy(&width, base + 4, sizeof(int));
+    memcpy(&height, base + 8, sizeof(int));
+
+    CheckFloHeader(tag, width, height, file_path);
+
+    int nBands = 2;
+    size_t n = (size_t)nBands * width * height * sizeof(float);
+    if (length < 12 + n)
+        throw CError("ReadFlowFile(%s): file is too short", file_path);
+    if (length > 12 + n)
+        throw CError("ReadFlowFile(%s): file is too long", file_path);
+
+    // wrap the payload; the header shares (and now holds) the mapping's reference count
+    cv::Mat flow_mat(height, width, CV_32FC2, u->data);
+    flow_mat.u = u;
+    flow_mat.addref();
+    FlowMatF32C2 = flow_mat;
+}
+
 // write a 2-band image into flow file 
 void FlowImage::WriteToFloFile(const char* file_path)
 {
@@ -95,8 +330,8 @@ void FlowImage::WriteToFloFile(const char* file_path)
     if (strcmp(dot, ".flo") != 0)
         throw CError("WriteFlowFile: file_path '%s' should have extension '.flo'", file_path);
 
-    int width = FlowMatF32C2.rows;
-    int height = FlowMatF32C2.cols;
+    int width = FlowMatF32C2.cols;
+    int height = FlowMatF32C2.rows;
     int nBands = FlowMatF32C2.channels();
 
     if (nBands != 2)
@@ -113,61 +348,27 @@ void FlowImage::WriteToFloFile(const char* file_path)
         throw CError("WriteFlowFile(%s): problem writing header", file_path);
 
     // write the rows
-    int n = nBands * width * height;
-    if ((int)fwrite(FlowMatF32C2.data, sizeof(float), n, stream) != n)
+    size_t n = (size_t)nBands * width * height;
+    if (fwrite(FlowMatF32C2.data, sizeof(float), n, stream) != n)
         throw CError("WriteFlowFile(%s): problem writing data", file_path);
 
     fclose(stream);
 }
 
-inline void FlowImage::SetColorWheelColor(int r, int g, int b, int k)
-{
-    ColorWheel[k][0] = r;
-    ColorWheel[k][1] = g;
-    ColorWheel[k][2] = b;
-}
-
-void FlowImage::MakeColorWheel()
-{
-    // relative lengths of color transitions:
-    // these are chosen based on perceptual similarity
-    // (e.g. one can distinguish more shades between red and yellow 
-    //  than between yellow and green)
-    int RY = 15;
-    int YG = 6;
-    int GC = 4;
-    int CB = 11;
-    int BM = 13;
-    int MR = 6;
-    ColorsCount = RY + YG + GC + CB + BM + MR;
-    //printf("ColorsCount = %d\n", ColorsCount);
-    if (ColorsCount > ColorsCountMax)
-        exit(1);
-    int i;
-    int k = 0;
-    for (i = 0; i < RY; i++) SetColorWheelColor(255, 255 * i / RY, 0, k++);
-    for (i = 0; i < YG; i++) SetColorWheelColor(255 - 255 * i / YG, 255, 0, k++);
-    for (i = 0; i < GC; i++) SetColorWheelColor(0, 255, 255 * i / GC, k++);
-    for (i = 0; i < CB; i++) SetColorWheelColor(0, 255 - 255 * i / CB, 255, k++);
-    for (i = 0; i < BM; i++) SetColorWheelColor(255 * i / BM, 0, 255, k++);
-    for (i = 0; i < MR; i++) SetColorWheelColor(255, 0, 255 - 255 * i / MR, k++);
-}
-
 inline void FlowImage::GetColor(float fx, float fy, unsigned char *pix)
 {
-    if (ColorsCount == 0) { MakeColorWheel(); }
-
+    const int ColorsCount = CColorWheel::ncols;
     float rad = sqrt(fx * fx + fy * fy);
     float a = atan2(-fy, -fx) / 3.14159265358979323846;
     float fk = (a + 1.0) / 2.0 * (ColorsCount - 1);
     int k0 = (int)fk;
-    int k1 = (k0 + 1) % ColorsCount;
+    int k1 = k0 + 1;    // the table repeats entry 0 at the end
     float f = fk - k0;
     //f = 0; // uncomment to see original color wheel
     for (int b = 0; b < 3; b++)
     {
-        float col0 = ColorWheel[k0][b] / 255.0;
-        float col1 = ColorWheel[k1][b] / 255.0;
+        float col0 = colorwheelf[b][k0];
+        float col1 = colorwheelf[b][k1];
         float col = (1 - f) * col0 + f * col1;
         if (rad <= 1)
             col = 1 - rad * (1 - col); // increase saturation with radius
@@ -190,7 +391,7 @@ void FlowImage::GetReferenceImage(cv::Mat& reference_image, float flow_l2_distan
         int s2 = image_one_side_length / 2;
         for (int y = 0; y < image_one_side_length; y++)
         {
-            int row_offset = y * image_one_side_length;
+            size_t row_offset = (size_t)y * image_one_side_length;
             uchar* rgb_row_ptr = reference_image.data + 3 * row_offset;
             for (int x = 0; x < image_one_side_length; x++)
             {
@@ -223,35 +424,47 @@ void FlowImage::GetReferenceImage(cv::Mat& reference_image, float flow_l2_distan
     }
 }
 
-float FlowImage::GetFlowL2DistanceMaximum()
+void FlowImage::GetFlowStats(CFlowStats& stats)
 {
     int width = FlowMatF32C2.cols;
     int height = FlowMatF32C2.rows;
 
-    float maxx = -1e10, maxy = -1e10;
-    float minx = 1e10, miny = 1e10;
-    float ret = -1;
-    for (int y = 0; y < height; y++)
+    // vectorized CFlowStats::AddRow on chunks of rows in parallel,
+    // one partial result per chunk, merged in chunk order
+    int chunks_count = std::max(1, std::min(height, cv::getNumThreads() * 4));
+    std::vector<CFlowStats> partial_stats(chunks_count);
+    cv::parallel_for_(cv::Range(0, chunks_count), [&](const cv::Range& range)
     {
-        int row_offset = y * width;
-        float* flow_row_ptr = ((float*)FlowMatF32C2.data) + 2 * row_offset;
-        for (int x = 0; x < width; x++)
+        for (int chunk = range.start; chunk < range.end; chunk++)
         {
-            float fx = flow_row_ptr[2 * x + 0];
-            float fy = flow_row_ptr[2 * x + 1];
-            if (IsUnknownFlow(fx, fy)) { continue; }
-            maxx = std::max(maxx, fx);
-            maxy = std::max(maxy, fy);
-            minx = std::min(minx, fx);
-            miny = std::min(miny, fy);
-            float rad = sqrt(fx * fx + fy * fy);
-            ret = std::max(ret, rad);
+            int y_begin = (int)((long long)height * chunk / chunks_count);
+            int y_end = (int)((long long)height * (chunk + 1) / chunks_count);
+            for (int y = y_begin; y < y_end; y++)
+            {
+                size_t row_offset = (size_t)y * width;
+                float* flow_row_ptr = ((float*)FlowMatF32C2.data) + 2 * row_offset;
+                partial_stats[chunk].AddRow(flow_row_ptr, width);
+            }
         }
-    }
+    });
+    stats.Clear();
+    for (auto&& s : partial_stats) { stats.Merge(s); }
+}
+
+float FlowImage::GetFlowL2DistanceMaximum()
+{
+    CFlowStats stats;
+    GetFlowStats(stats);
+    return GetFlowL2DistanceMaximum(stats);
+}
+
+float FlowImage::GetFlowL2DistanceMaximum(const CFlowStats& stats)
+{
+    float ret = stats.maxrad;
 
     if (IsVerbose)
     {
-        printf("max motion: %.4f  motion range: u = %.3f .. %.3f;  v = %.3f .. %.3f\n", ret, minx, maxx, miny, maxy);
+        printf("max motion: %.4f  motion range: u = %.3f .. %.3f;  v = %.3f .. %.3f\n", ret, stats.minu, stats.maxu, stats.minv, stats.maxv);
     }
 
     // if flow == 0 everywhere
@@ -274,21 +487,17 @@ void FlowImage::GetColorFlowImage(cv::Mat& color_flow_image, float flow_l2_dista
         color_flow_image = cv::Mat(height, width, CV_8UC3);
     }
 
-    for (int y = 0; y < height; y++)
+    // rows are independent: split them across OpenCV's threads (see cv::setNumThreads)
+    cv::parallel_for_(cv::Range(0, height), [&](const cv::Range& range)
     {
-        int row_offset = y * width;
-        float* flow_row_ptr = ((float*)FlowMatF32C2.data) + 2 * row_offset;
-        uchar* rgb_row_ptr = color_flow_image.data + 3 * row_offset;
-        for (int x = 0; x < width; x++)
+        for (int y = range.start; y < range.end; y++)
         {
-            float fx = flow_row_ptr[2 * x + 0];
-            float fy = flow_row_ptr[2 * x + 1];
-            uchar* pix = rgb_row_ptr + 3 * x;
-            if (IsUnknownFlow(fx, fy)) { pix[0] = pix[1] = pix[2] = 0; }
-            else
-            {
-                GetColor(fx / flow_l2_distance_max, fy / flow_l2_distance_max, pix);
-            }
+            size_t row_offset = (size_t)y * width;
+            float* flow_row_ptr = ((float*)FlowMatF32C2.data) + 2 * row_offset;
+            uchar* rgb_row_ptr = color_flow_image.data + 3 * row_offset;
+            // row kernels shared with the original flow-code
+            if (UseColorLUT) { computeColorRowLUT(flow_row_ptr, rgb_row_ptr, width, flow_l2_distance_max); }
+            else { computeColorRow(flow_row_ptr, rgb_row_ptr, width, flow_l2_distance_max); }
         }
-    }
+    });
 }
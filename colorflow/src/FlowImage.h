@@ -5,8 +5,10 @@
 
 #include <opencv2/core.hpp>
 #include <string>
+#include <vector>
 #include <cmath>
 #include <exception>
+#include "flowStats.h"
 
 struct CError : public std::exception
 {
@@ -29,13 +31,15 @@ public:
     // value to use to represent unknown flow
     static float UnknownFlow() { return 1e10; }
 
-    static const int ColorsCountMax = 60;
+    // largest width or height the readers accept; guards against garbage headers,
+    // raise it for huge mosaics
+    static int FloMaxDimension;
 
     // return whether flow vector is unknown
     static bool IsUnknownFlow(float u, float v)
     {
-        return (fabs(u) > UnknownFlow())
-            || (fabs(v) > UnknownFlow())
+        return (fabs(u) > UnknownFlowThresh())
+            || (fabs(v) > UnknownFlowThresh())
             || std::isnan(u) || std::isnan(v);
     }
     static bool IsUnknownFlow(float *f) { return IsUnknownFlow(f[0], f[1]); }
@@ -47,22 +51,42 @@ public:
     FlowImage()
     {
         IsVerbose = false;
-        ColorsCount = 0;
+        UseColorLUT = false;
     }
 
+    struct FloHeader
+    {
+        int width, height;  // dimensions of the (2-band) flow
+        size_t bytes;       // expected file size: 12-byte header + width * height * 2 floats
+        bool valid;         // header is sane and the file has the expected size;
+                            // only false in ReadHeadersFromFloFiles results
+    };
+    // read only the 12-byte header of a .flo file and check it against the file size;
+    // throws CError on any problem, so a returned header is always valid
+    static FloHeader ReadHeaderFromFloFile(const char* file_path);
+    // probe many .flo files; does not throw, invalid files are marked in the result
+    static void ReadHeadersFromFloFiles(const std::vector<std::string>& file_paths, std::vector<FloHeader>& headers);
+
     void ReadFromFloFile(const char* file_path);
+    // read and compute the motion range statistics while the rows are read
+    void ReadFromFloFile(const char* file_path, CFlowStats& stats);
+    // map the file copy-on-write and let FlowMatF32C2 point into the mapping (no copy);
+    // the mapping is released together with the last cv::Mat that refers to it
+    void ReadFromFloFileMapped(const char* file_path);
     void WriteToFloFile(const char* file_path);
 
     bool IsVerbose;
-    int ColorWheel[ColorsCountMax][3];
-    int ColorsCount;
+    // GetColorFlowImage looks the colors up in a quantized table (computeColorRowLUT)
+    bool UseColorLUT;
 
-    void SetColorWheelColor(int r, int g, int b, int k);
-    void MakeColorWheel();
+    // color-code one normalized flow vector (colorwheel.h), see also computeColorRow
     void GetColor(float fx, float fy, unsigned char *pix);
 
     void GetReferenceImage(cv::Mat& reference_image, float flow_l2_distance_max, int image_one_side_length);
+    // motion range, mean magnitude and number of unknown vectors of FlowMatF32C2
+    void GetFlowStats(CFlowStats& stats);
     float GetFlowL2DistanceMaximum();
+    float GetFlowL2DistanceMaximum(const CFlowStats& stats);
     void GetColorFlowImage(cv::Mat& color_flow_image, float flow_l2_distance_max);
 };
 
@@ -9,6 +9,22 @@
 
 using namespace std;
 
+// cv::imwrite parameters of a png preset (see CPngOptions in imageLib/ImageIO.h):
+// "fastest", "fast", "default", "smallest", or a zlib level 0..9.
+// OpenCV does not let us pick the row filter, so only the zlib level and
+// strategy follow the preset.
+static vector<int> PngParams(const char *name)
+{
+    int level, strategy = cv::IMWRITE_PNG_STRATEGY_DEFAULT;
+    if (strcmp(name, "fastest") == 0) { level = 0; }
+    else if (strcmp(name, "fast") == 0) { level = 1; strategy = cv::IMWRITE_PNG_STRATEGY_RLE; }
+    else if (strcmp(name, "default") == 0) { level = 6; strategy = cv::IMWRITE_PNG_STRATEGY_FILTERED; }
+    else if (strcmp(name, "smallest") == 0) { level = 9; strategy = cv::IMWRITE_PNG_STRATEGY_FILTERED; }
+    else if (name[0] >= '0' && name[0] <= '9' && name[1] == 0) { level = name[0] - '0'; }
+    else throw CError("colorflow: unknown png preset %s (use fastest, fast, default, smallest or 0..9)", name);
+    return vector<int>{ cv::IMWRITE_PNG_COMPRESSION, level, cv::IMWRITE_PNG_STRATEGY, strategy };
+}
+
 int main(int argc, char *argv[])
 {
 #if 0
@@ -39,11 +55,18 @@ int main(int argc, char *argv[])
         }
         else
         {
-            if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'q')
+            // default to one thread, like color_flow; -threads 0 uses all cores
+            int threads_count = 1;
+            vector<int> png_params;     // OpenCV defaults (zlib level 1, Z_RLE)
+            for (; argn < argc && argv[argn][0] == '-'; argn++)
             {
-                flow_image.IsVerbose = false;
-                argn++;
+                if (argv[argn][1] == 'q') { flow_image.IsVerbose = false; }
+                else if (argv[argn][1] == 'l') { flow_image.UseColorLUT = true; }
+                else if (argv[argn][1] == 't' && argn + 1 < argc) { threads_count = atoi(argv[++argn]); }
+                else if (argv[argn][1] == 'p' && argn + 1 < argc) { png_params = PngParams(argv[++argn]); }
+                else { argn = argc; }   // unknown option: show usage
             }
+            cv::setNumThreads(threads_count > 0 ? threads_count : -1);
             if (argn + 1 <= argc && argc <= argn + 3)
             {
                 std::string flo_file_path(argv[argn++]);
@@ -59,20 +82,33 @@ int main(int argc, char *argv[])
                 argn++;
 
                 {
-                    flow_image.ReadFromFloFile(flo_file_path.c_str());
-                    if (flow_l2_distance_max < 0)
+                    if (flow_l2_distance_max < 0 && threads_count != 1)
                     {
+                        // plain read, then the motion range in parallel
+                        flow_image.ReadFromFloFile(flo_file_path.c_str());
                         flow_l2_distance_max = flow_image.GetFlowL2DistanceMaximum();
                     }
+                    else if (flow_l2_distance_max < 0)
+                    {
+                        // compute the normalization while the rows come in
+                        CFlowStats stats;
+                        flow_image.ReadFromFloFile(flo_file_path.c_str(), stats);
+                        flow_l2_distance_max = flow_image.GetFlowL2DistanceMaximum(stats);
+                    }
+                    else
+                    {
+                        flow_image.ReadFromFloFile(flo_file_path.c_str());
+                    }
                     cv::Mat color_flow_image;
                     flow_image.GetColorFlowImage(color_flow_image, flow_l2_distance_max);
-                    cv::imwrite(color_flow_image_png_file_path.c_str(), color_flow_image);
+                    cv::imwrite(color_flow_image_png_file_path.c_str(), color_flow_image, png_params);
                 }
             }
             else
             {
                 const char *usage = "\n"
-                    "  usage: colorflow [-quiet] in.flo [out.png] [flow_l2_distance_max]\n"
+                    "  usage: colorflow [-quiet] [-threads n] [-lut] [-png preset] in.flo [out.png] [flow_l2_distance_max]\n"
+                    "         -png: fastest, fast, default, smallest, or a zlib level 0..9\n"
                     "     or: colorflow -colortest [flow_l2_distance_max] [image_size] \n";
                 throw CError(usage);
             }
@@ -0,0 +1,43 @@
+// matblur.cpp
+// smooth an image with imageLib's ConvolveSeparable, reading and writing
+// it with the OpenCV codecs.  ImageMat.h shares the pixels both ways, so
+// nothing is copied between cv::Mat and CImage.
+
+static const char *usage = "\n  usage: %s in.png out.png\n";
+
+#include <stdio.h>
+#include <opencv2/imgcodecs.hpp>
+#include "imageLib.h"
+#include "Convolve.h"
+#include "ImageMat.h"
+
+int main(int argc, char *argv[])
+{
+    try {
+	if (argc != 3)
+	    throw CError(usage, argv[0]);
+
+	cv::Mat in = cv::imread(argv[1], cv::IMREAD_UNCHANGED);
+	if (in.empty())
+	    throw CError("matblur: could not read %s", argv[1]);
+	if (in.depth() != CV_8U)
+	    throw CError("matblur: %s is not an 8-bit image", argv[1]);
+
+	CByteImage img, blurred;
+	WrapMat(in, img);		// img uses the pixels of in
+	img.borderMode = eBorderReplicate;
+	ConvolveSeparable(img, blurred, ConvolveKernel_14641, ConvolveKernel_14641,
+			  1.0f, 0.0f, 1, 1);
+
+	cv::Mat out = WrapImage(blurred);	// a cv::Mat header on the pixels of blurred
+	if (!cv::imwrite(argv[2], out))
+	    throw CError("matblur: could not write %s", argv[2]);
+    }
+    catch (CError &err) {
+	fprintf(stderr, err.message, argv[0]);
+	fprintf(stderr, "\n");
+	return -1;
+    }
+
+    return 0;
+}
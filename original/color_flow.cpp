@@ -4,7 +4,13 @@
 
 // DS 2/9/08 fixed bug in MotionToColor concerning reallocation of colim (thanks Yunpeng!)
 
-static const char *usage = "\n  usage: %s [-quiet] in.flo out.png [maxmotion]\n";
+static const char *usage = "\n  usage: %s [-quiet] [-stream] [-threads n] [-lut] [-png preset] in.flo out.png [maxmotion]\n"
+    "\n  -stream: read, color-code and write the image in bands of rows (png only),"
+    "\n           for flow fields that do not fit into memory"
+    "\n  -threads n: color-code and encode the png with n threads (0 = one per core; default 1)"
+    "\n  -lut: look the colors up in a quantized table (faster, see colorcode.h)"
+    "\n  -png preset: fastest, fast, default, smallest, or a zlib level 0..9"
+    "\n           (speed vs. size of the png file, see README.txt)\n";
 
 #include <stdio.h>
 #include <math.h>
@@ -13,33 +19,41 @@ static const char *usage = "\n  usage: %s [-quiet] in.flo out.png [maxmotion]\n"
 #include "colorcode.h"
 
 int verbose = 1;
+bool useLUT = false;
+CPngOptions pngOptions;
 
-void MotionToColor(CFloatImage motim, CByteImage &colim, float maxmotion)
+// number of rows per band in the streaming pipeline
+#define STREAM_BAND_ROWS 64
+
+// color-code one row of interleaved u, v values
+static void MotionToColorRow(const float *uv, uchar *pix, int width, float maxrad)
+{
+    if (useLUT)
+	computeColorRowLUT(uv, pix, width, maxrad);
+    else
+	computeColorRow(uv, pix, width, maxrad);
+}
+
+// color-code rows [0, nRows) of a flow band, split across ThreadCount() threads
+static void MotionToColorRows(const CFloatImage &motim, CByteImage &colim, int nRows, float maxrad)
+{
+    int width = motim.Shape().width;
+    ParallelFor(0, nRows, [&](int lo, int hi) {
+	for (int y = lo; y < hi; y++)
+	    MotionToColorRow(&motim.Pixel(0, y, 0), &colim.Pixel(0, y, 0), width, maxrad);
+    });
+}
+
+// color-code motion field, given its motion range statistics (e.g., from ReadFlowFile)
+void MotionToColor(const CFloatImage &motim, CByteImage &colim, float maxmotion,
+		   const CFlowStats& stats)
 {
     CShape sh = motim.Shape();
     int width = sh.width, height = sh.height;
     colim.ReAllocate(CShape(width, height, 3));
-    int x, y;
-    // determine motion range:
-    float maxx = -999, maxy = -999;
-    float minx =  999, miny =  999;
-    float maxrad = -1;
-    for (y = 0; y < height; y++) {
-	for (x = 0; x < width; x++) {
-	    float fx = motim.Pixel(x, y, 0);
-	    float fy = motim.Pixel(x, y, 1);
-	    if (unknown_flow(fx, fy))
-		continue;
-	    maxx = __max(maxx, fx);
-	    maxy = __max(maxy, fy);
-	    minx = __min(minx, fx);
-	    miny = __min(miny, fy);
-	    float rad = sqrt(fx * fx + fy * fy);
-	    maxrad = __max(maxrad, rad);
-	}
-    }
+    float maxrad = stats.maxrad;
     printf("max motion: %.4f  motion range: u = %.3f .. %.3f;  v = %.3f .. %.3f\n",
-	   maxrad, minx, maxx, miny, maxy);
+	   maxrad, stats.minu, stats.maxu, stats.minv, stats.maxv);
 
 
     if (maxmotion > 0) // i.e., specified on commandline
@@ -51,41 +65,102 @@ void MotionToColor(CFloatImage motim, CByteImage &colim, float maxmotion)
     if (verbose)
 	fprintf(stderr, "normalizing by %g\n", maxrad);
 
-    for (y = 0; y < height; y++) {
-	for (x = 0; x < width; x++) {
-	    float fx = motim.Pixel(x, y, 0);
-	    float fy = motim.Pixel(x, y, 1);
-	    uchar *pix = &colim.Pixel(x, y, 0);
-	    if (unknown_flow(fx, fy)) {
-		pix[0] = pix[1] = pix[2] = 0;
-	    } else {
-		computeColor(fx/maxrad, fy/maxrad, pix);
-	    }
-	}
+    MotionToColorRows(motim, colim, height, maxrad);
+}
+
+void MotionToColor(const CFloatImage &motim, CByteImage &colim, float maxmotion)
+{
+    // determine motion range:
+    CFlowStats stats;
+    AddFlowStats(motim, stats);
+    MotionToColor(motim, colim, maxmotion, stats);
+}
+
+// color-code a flow file in bands of rows and hand each finished band to
+// libpng, so that peak memory is one float band and one byte band
+// instead of the whole flow plus the whole color image
+void MotionToColorStreamed(const char *flowname, const char *outname, float maxmotion)
+{
+    CFlowReader reader(flowname);
+    CShape sh = reader.Shape();
+    int width = sh.width, height = sh.height;
+    CFloatImage band;
+    int n;
+
+    float maxrad = maxmotion;
+    if (maxmotion <= 0) { // not specified on commandline: first pass for the motion range
+	CFlowStats stats;
+	while ((n = reader.ReadRows(band, STREAM_BAND_ROWS)) > 0)
+	    AddFlowStats(band, stats, n);
+	printf("max motion: %.4f  motion range: u = %.3f .. %.3f;  v = %.3f .. %.3f\n",
+	       stats.maxrad, stats.minu, stats.maxu, stats.minv, stats.maxv);
+	maxrad = stats.maxrad;
+	reader.Rewind();
     }
+
+    if (maxrad == 0) // if flow == 0 everywhere
+	maxrad = 1;
+
+    if (verbose)
+	fprintf(stderr, "normalizing by %g\n", maxrad);
+
+    if (verbose)
+	fprintf(stderr, "Writing image %s in bands of %d rows\n", outname, STREAM_BAND_ROWS);
+    CPngRowWriter writer;
+    writer.Open(outname, width, height, 3, pngOptions);
+    CByteImage colband(CShape(width, STREAM_BAND_ROWS, 3));
+    while ((n = reader.ReadRows(band, STREAM_BAND_ROWS)) > 0) {
+	MotionToColorRows(band, colband, n, maxrad);
+	writer.WriteRows(colband, n);
+    }
+    writer.Close();
 }
 
 int main(int argc, char *argv[])
 {
     try {
 	int argn = 1;
-	if (argc > 1 && argv[1][0]=='-' && argv[1][1]=='q') {
-	    verbose = 0;
-	    argn++;
+	bool streamed = false;
+	for (; argn < argc && argv[argn][0]=='-'; argn++) {
+	    if (argv[argn][1]=='q')
+		verbose = 0;
+	    else if (argv[argn][1]=='s')
+		streamed = true;
+	    else if (argv[argn][1]=='l')
+		useLUT = true;
+	    else if (argv[argn][1]=='t' && argn+1 < argc)
+		SetThreadCount(atoi(argv[++argn]));
+	    else if (argv[argn][1]=='p' && argn+1 < argc)
+		pngOptions = CPngOptions::FromName(argv[++argn]);
+	    else
+		throw CError(usage, argv[0]);
 	}
 	if (argn >= argc-3 && argn <= argc-2) {
 	    char *flowname = argv[argn++];
 	    char *outname = argv[argn++];
 	    float maxmotion = argn < argc ? atof(argv[argn++]) : -1;
+	    if (streamed) {
+		const char *dot = strrchr(outname, '.');
+		if (dot == NULL || strcmp(dot, ".png") != 0)
+		    throw CError("color_flow: -stream can only write png files, not %s", outname);
+		MotionToColorStreamed(flowname, outname, maxmotion);
+		return 0;
+	    }
 	    CFloatImage im, fband;
-	    ReadFlowFile(im, flowname);
+	    CFlowStats stats;
+	    if (ThreadCount() > 1) { // plain read, then the motion range in parallel
+		ReadFlowFile(im, flowname);
+		AddFlowStats(im, stats);
+	    } else		     // motion range while the rows are read
+		ReadFlowFile(im, flowname, stats);
 	    CByteImage band, outim;
 	    CShape sh = im.Shape();
 	    sh.nBands = 3;
 	    outim.ReAllocate(sh);
 	    outim.ClearPixels();
-	    MotionToColor(im, outim, maxmotion);
-	    WriteImageVerb(outim, outname, verbose);
+	    MotionToColor(im, outim, maxmotion, stats);
+	    pngOptions.nThreads = 0;	// deflate strips of rows on the -threads threads
+	    WriteImageVerb(outim, outname, verbose, pngOptions);
 	} else
 	    throw CError(usage, argv[0]);
     }
@@ -6,64 +6,30 @@
 //
 // Daniel Scharstein, 4/2007
 // added tick marks and out-of-range coding 6/05/07
+//
+// computeColorRow is a vectorized (SSE2/AVX2) version for whole rows of flow
 
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
+#include "flowStats.h"	// UNKNOWN_FLOW_THRESH
+#include "colorwheel.h"
 typedef unsigned char uchar;
 
-int ncols = 0;
-#define MAXCOLS 60
-int colorwheel[MAXCOLS][3];
-
-
-void setcols(int r, int g, int b, int k)
-{
-    colorwheel[k][0] = r;
-    colorwheel[k][1] = g;
-    colorwheel[k][2] = b;
-}
-
-void makecolorwheel()
-{
-    // relative lengths of color transitions:
-    // these are chosen based on perceptual similarity
-    // (e.g. one can distinguish more shades between red and yellow 
-    //  than between yellow and green)
-    int RY = 15;
-    int YG = 6;
-    int GC = 4;
-    int CB = 11;
-    int BM = 13;
-    int MR = 6;
-    ncols = RY + YG + GC + CB + BM + MR;
-    //printf("ncols = %d\n", ncols);
-    if (ncols > MAXCOLS)
-	exit(1);
-    int i;
-    int k = 0;
-    for (i = 0; i < RY; i++) setcols(255,	   255*i/RY,	 0,	       k++);
-    for (i = 0; i < YG; i++) setcols(255-255*i/YG, 255,		 0,	       k++);
-    for (i = 0; i < GC; i++) setcols(0,		   255,		 255*i/GC,     k++);
-    for (i = 0; i < CB; i++) setcols(0,		   255-255*i/CB, 255,	       k++);
-    for (i = 0; i < BM; i++) setcols(255*i/BM,	   0,		 255,	       k++);
-    for (i = 0; i < MR; i++) setcols(255,	   0,		 255-255*i/MR, k++);
-}
+static const int ncols = CColorWheel::ncols;	// colorwheelf has ncols + 1 entries
 
 void computeColor(float fx, float fy, uchar *pix)
 {
-    if (ncols == 0)
-	makecolorwheel();
-
     float rad = sqrt(fx * fx + fy * fy);
     float a = atan2(-fy, -fx) / M_PI;
     float fk = (a + 1.0) / 2.0 * (ncols-1);
     int k0 = (int)fk;
-    int k1 = (k0 + 1) % ncols;
+    int k1 = k0 + 1;
     float f = fk - k0;
     //f = 0; // uncomment to see original color wheel
     for (int b = 0; b < 3; b++) {
-	float col0 = colorwheel[k0][b] / 255.0;
-	float col1 = colorwheel[k1][b] / 255.0;
+	float col0 = colorwheelf[b][k0];
+	float col1 = colorwheelf[b][k1];
 	float col = (1 - f) * col0 + f * col1;
 	if (rad <= 1)
 	    col = 1 - rad * (1 - col); // increase saturation with radius
@@ -72,3 +38,342 @@ void computeColor(float fx, float fy, uchar *pix)
 	pix[2 - b] = (int)(255.0 * col);
     }
 }
+
+
+//
+// Row kernel
+//
+// All code paths below evaluate exactly the same sequence of float
+// operations, so that the scalar, SSE2 and AVX2 versions give identical
+// bytes.  atan2 is replaced by an odd polynomial for atan on [0, 1]
+// (max error 2e-6 radians, far below one 8-bit color step), and the
+// result is mapped to the quadrant with the sign bits of x and y, like
+// atan2 (including signed zeros).
+//
+
+#define ATAN_C0   0.99997726f
+#define ATAN_C1  -0.33262347f
+#define ATAN_C2   0.19354346f
+#define ATAN_C3  -0.11643287f
+#define ATAN_C4   0.05265332f
+#define ATAN_C5  -0.01172120f
+#define PI_F      3.14159265f
+#define PI_2_F    1.57079633f
+
+// color-code one flow vector (scalar reference for the vectorized kernels)
+static inline void computeColorPixel(float u, float v, float maxrad, uchar *pix)
+{
+    if (fabsf(u) > (float)UNKNOWN_FLOW_THRESH || fabsf(v) > (float)UNKNOWN_FLOW_THRESH ||
+	u != u || v != v) {
+	pix[0] = pix[1] = pix[2] = 0;
+	return;
+    }
+    float fx = u / maxrad;
+    float fy = v / maxrad;
+    float rad = sqrtf(fx * fx + fy * fy);
+
+    // a = atan2(-fy, -fx)
+    float x = -fx, y = -fy;
+    float ax = fabsf(x), ay = fabsf(y);
+    float mx = ax > ay ? ax : ay;
+    float mn = ax < ay ? ax : ay;
+    float t = mn / (mx > FLT_MIN ? mx : FLT_MIN);
+    float t2 = t * t;
+    float p = ATAN_C5 * t2 + ATAN_C4;
+    p = p * t2 + ATAN_C3;
+    p = p * t2 + ATAN_C2;
+    p = p * t2 + ATAN_C1;
+    p = p * t2 + ATAN_C0;
+    float a = p * t;
+    if (ay > ax)
+	a = PI_2_F - a;
+    if (signbit(x))
+	a = PI_F - a;
+    if (signbit(y))
+	a = -a;
+
+    float fk = a * ((ncols - 1) / (2 * PI_F)) + (ncols - 1) * 0.5f;
+    fk = fk > 0 ? fk : 0;
+    fk = fk < ncols - 1 ? fk : ncols - 1;
+    int k0 = (int)fk;
+    float f = fk - k0;
+    for (int b = 0; b < 3; b++) {
+	float col = (1 - f) * colorwheelf[b][k0] + f * colorwheelf[b][k0 + 1];
+	if (rad <= 1)
+	    col = 1 - rad * (1 - col); // increase saturation with radius
+	else
+	    col *= .75f; // out of range
+	pix[2 - b] = (int)(255.0f * col);
+    }
+}
+
+static void computeColorRowScalar(const float *uv, uchar *pix, int n, float maxrad)
+{
+    for (int i = 0; i < n; i++)
+	computeColorPixel(uv[2 * i], uv[2 * i + 1], maxrad, &pix[3 * i]);
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COLORCODE_SSE2
+#include <emmintrin.h>
+
+static void computeColorRowSSE2(const float *uv, uchar *pix, int n, float maxrad)
+{
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 thresh = _mm_set1_ps((float)UNKNOWN_FLOW_THRESH);
+    const __m128 vmaxrad = _mm_set1_ps(maxrad);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 kScale = _mm_set1_ps((ncols - 1) / (2 * PI_F));
+    const __m128 kOffset = _mm_set1_ps((ncols - 1) * 0.5f);
+    const __m128 kMax = _mm_set1_ps((float)(ncols - 1));
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+	__m128 a0 = _mm_loadu_ps(uv + 2 * i);
+	__m128 a1 = _mm_loadu_ps(uv + 2 * i + 4);
+	__m128 u = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 v = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1));
+
+	__m128 unknown = _mm_or_ps(
+	    _mm_or_ps(_mm_cmpgt_ps(_mm_andnot_ps(signMask, u), thresh),
+		      _mm_cmpgt_ps(_mm_andnot_ps(signMask, v), thresh)),
+	    _mm_cmpunord_ps(u, v));
+
+	__m128 fx = _mm_div_ps(u, vmaxrad);
+	__m128 fy = _mm_div_ps(v, vmaxrad);
+	__m128 rad = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)));
+
+	// a = atan2(-fy, -fx)
+	__m128 x = _mm_xor_ps(fx, signMask);
+	__m128 y = _mm_xor_ps(fy, signMask);
+	__m128 ax = _mm_andnot_ps(signMask, x);
+	__m128 ay = _mm_andnot_ps(signMask, y);
+	__m128 mx = _mm_max_ps(ax, ay);
+	__m128 mn = _mm_min_ps(ax, ay);
+	__m128 t = _mm_div_ps(mn, _mm_max_ps(mx, _mm_set1_ps(FLT_MIN)));
+	__m128 t2 = _mm_mul_ps(t, t);
+	__m128 p = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ATAN_C5), t2), _mm_set1_ps(ATAN_C4));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(ATAN_C3));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(ATAN_C2));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(ATAN_C1));
+	p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(ATAN_C0));
+	__m128 a = _mm_mul_ps(p, t);
+	__m128 swap = _mm_cmpgt_ps(ay, ax);
+	a = _mm_or_ps(_mm_and_ps(swap, _mm_sub_ps(_mm_set1_ps(PI_2_F), a)),
+		      _mm_andnot_ps(swap, a));
+	__m128 xneg = _mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(x), 31));
+	a = _mm_or_ps(_mm_and_ps(xneg, _mm_sub_ps(_mm_set1_ps(PI_F), a)),
+		      _mm_andnot_ps(xneg, a));
+	a = _mm_xor_ps(a, _mm_and_ps(y, signMask));
+
+	__m128 fk = _mm_add_ps(_mm_mul_ps(a, kScale), kOffset);
+	fk = _mm_min_ps(_mm_max_ps(fk, zero), kMax);
+	__m128i k0 = _mm_cvttps_epi32(fk);
+	__m128 f = _mm_sub_ps(fk, _mm_cvtepi32_ps(k0));
+	__m128 f1 = _mm_sub_ps(one, f);
+	__m128 inRange = _mm_cmple_ps(rad, one);
+
+	int k[4];
+	_mm_storeu_si128((__m128i *)k, k0);
+	int c[3][4];
+	for (int b = 0; b < 3; b++) {
+	    const float *w = colorwheelf[b];
+	    __m128 col0 = _mm_setr_ps(w[k[0]], w[k[1]], w[k[2]], w[k[3]]);
+	    __m128 col1 = _mm_setr_ps(w[k[0] + 1], w[k[1] + 1], w[k[2] + 1], w[k[3] + 1]);
+	    __m128 col = _mm_add_ps(_mm_mul_ps(f1, col0), _mm_mul_ps(f, col1));
+	    __m128 colIn = _mm_sub_ps(one, _mm_mul_ps(rad, _mm_sub_ps(one, col)));
+	    __m128 colOut = _mm_mul_ps(col, _mm_set1_ps(.75f));
+	    col = _mm_or_ps(_mm_and_ps(inRange, colIn), _mm_andnot_ps(inRange, colOut));
+	    __m128i ci = _mm_cvttps_epi32(_mm_mul_ps(col, _mm_set1_ps(255.0f)));
+	    ci = _mm_andnot_si128(_mm_castps_si128(unknown), ci);
+	    _mm_storeu_si128((__m128i *)c[b], ci);
+	}
+	uchar *p3 = pix + 3 * i;
+	for (int j = 0; j < 4; j++, p3 += 3) {
+	    p3[0] = (uchar)c[2][j];
+	    p3[1] = (uchar)c[1][j];
+	    p3[2] = (uchar)c[0][j];
+	}
+    }
+    computeColorRowScalar(uv + 2 * i, pix + 3 * i, n - i, maxrad);
+}
+#endif
+
+#if defined(COLORCODE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COLORCODE_AVX2
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void computeColorRowAVX2(const float *uv, uchar *pix, int n, float maxrad)
+{
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    const __m256 thresh = _mm256_set1_ps((float)UNKNOWN_FLOW_THRESH);
+    const __m256 vmaxrad = _mm256_set1_ps(maxrad);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 kScale = _mm256_set1_ps((ncols - 1) / (2 * PI_F));
+    const __m256 kOffset = _mm256_set1_ps((ncols - 1) * 0.5f);
+    const __m256 kMax = _mm256_set1_ps((float)(ncols - 1));
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+	__m256 a0 = _mm256_loadu_ps(uv + 2 * i);
+	__m256 a1 = _mm256_loadu_ps(uv + 2 * i + 8);
+	// shuffle gives u0 u1 u4 u5 | u2 u3 u6 u7, the permute restores the order
+	__m256 u = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+	    _mm256_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+	__m256 v = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(
+	    _mm256_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+
+	__m256 unknown = _mm256_or_ps(
+	    _mm256_or_ps(_mm256_cmp_ps(_mm256_andnot_ps(signMask, u), thresh, _CMP_GT_OQ),
+			 _mm256_cmp_ps(_mm256_andnot_ps(signMask, v), thresh, _CMP_GT_OQ)),
+	    _mm256_cmp_ps(u, v, _CMP_UNORD_Q));
+
+	__m256 fx = _mm256_div_ps(u, vmaxrad);
+	__m256 fy = _mm256_div_ps(v, vmaxrad);
+	__m256 rad = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(fx, fx), _mm256_mul_ps(fy, fy)));
+
+	// a = atan2(-fy, -fx)
+	__m256 x = _mm256_xor_ps(fx, signMask);
+	__m256 y = _mm256_xor_ps(fy, signMask);
+	__m256 ax = _mm256_andnot_ps(signMask, x);
+	__m256 ay = _mm256_andnot_ps(signMask, y);
+	__m256 mx = _mm256_max_ps(ax, ay);
+	__m256 mn = _mm256_min_ps(ax, ay);
+	__m256 t = _mm256_div_ps(mn, _mm256_max_ps(mx, _mm256_set1_ps(FLT_MIN)));
+	__m256 t2 = _mm256_mul_ps(t, t);
+	__m256 p = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(ATAN_C5), t2), _mm256_set1_ps(ATAN_C4));
+	p = _mm256_add_ps(_mm256_mul_ps(p, t2), _mm256_set1_ps(ATAN_C3));
+	p = _mm256_add_ps(_mm256_mul_ps(p, t2), _mm256_set1_ps(ATAN_C2));
+	p = _mm256_add_ps(_mm256_mul_ps(p, t2), _mm256_set1_ps(ATAN_C1));
+	p = _mm256_add_ps(_mm256_mul_ps(p, t2), _mm256_set1_ps(ATAN_C0));
+	__m256 a = _mm256_mul_ps(p, t);
+	a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(PI_2_F), a),
+			     _mm256_cmp_ps(ay, ax, _CMP_GT_OQ));
+	a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(PI_F), a), x);	// sign bit of x
+	a = _mm256_xor_ps(a, _mm256_and_ps(y, signMask));
+
+	__m256 fk = _mm256_add_ps(_mm256_mul_ps(a, kScale), kOffset);
+	fk = _mm256_min_ps(_mm256_max_ps(fk, zero), kMax);
+	__m256i k0 = _mm256_cvttps_epi32(fk);
+	__m256i k1 = _mm256_add_epi32(k0, _mm256_set1_epi32(1));
+	__m256 f = _mm256_sub_ps(fk, _mm256_cvtepi32_ps(k0));
+	__m256 f1 = _mm256_sub_ps(one, f);
+	__m256 inRange = _mm256_cmp_ps(rad, one, _CMP_LE_OQ);
+
+	int c[3][8];
+	for (int b = 0; b < 3; b++) {
+	    __m256 col0 = _mm256_i32gather_ps(colorwheelf[b], k0, 4);
+	    __m256 col1 = _mm256_i32gather_ps(colorwheelf[b], k1, 4);
+	    __m256 col = _mm256_add_ps(_mm256_mul_ps(f1, col0), _mm256_mul_ps(f, col1));
+	    __m256 colIn = _mm256_sub_ps(one, _mm256_mul_ps(rad, _mm256_sub_ps(one, col)));
+	    __m256 colOut = _mm256_mul_ps(col, _mm256_set1_ps(.75f));
+	    col = _mm256_blendv_ps(colOut, colIn, inRange);
+	    __m256i ci = _mm256_cvttps_epi32(_mm256_mul_ps(col, _mm256_set1_ps(255.0f)));
+	    ci = _mm256_andnot_si256(_mm256_castps_si256(unknown), ci);
+	    _mm256_storeu_si256((__m256i *)c[b], ci);
+	}
+	uchar *p3 = pix + 3 * i;
+	for (int j = 0; j < 8; j++, p3 += 3) {
+	    p3[0] = (uchar)c[2][j];
+	    p3[1] = (uchar)c[1][j];
+	    p3[2] = (uchar)c[0][j];
+	}
+    }
+    computeColorRowSSE2(uv + 2 * i, pix + 3 * i, n - i, maxrad);
+}
+#endif
+
+typedef void (*ColorRowFn)(const float *uv, uchar *pix, int n, float maxrad);
+
+// pick the widest kernel the CPU supports
+static ColorRowFn selectColorRowKernel()
+{
+#if defined(COLORCODE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return computeColorRowAVX2;
+#endif
+#if defined(COLORCODE_SSE2)
+    return computeColorRowSSE2;
+#else
+    return computeColorRowScalar;
+#endif
+}
+
+static ColorRowFn colorRowKernel = selectColorRowKernel();
+
+void computeColorRow(const float *uv, uchar *pix, int n, float maxrad)
+{
+    colorRowKernel(uv, pix, n, maxrad);
+}
+
+
+//
+// Lookup-table mode
+//
+// A COLOR_LUT_SIZE x COLOR_LUT_SIZE table of BGR triples samples the
+// row kernel at the cell centers of normalized flow in
+// [-COLOR_LUT_RANGE, COLOR_LUT_RANGE]^2, which includes a margin of the
+// out-of-range ring.  Vectors outside that square are scaled back onto
+// its border along their direction, which keeps their (ring) color.
+// With the default size of 1024 the colors are within 1 level of
+// computeColorRow, except in the cells that straddle the rad = 1 circle,
+// where the coding itself jumps to the darker out-of-range colors.
+//
+
+#ifndef COLOR_LUT_SIZE
+#define COLOR_LUT_SIZE 1024
+#endif
+#define COLOR_LUT_RANGE 1.0625f
+
+struct CColorLUT
+{
+    uchar bgr[COLOR_LUT_SIZE * COLOR_LUT_SIZE][3];
+
+    CColorLUT()
+    {
+	float scale = 2 * COLOR_LUT_RANGE / COLOR_LUT_SIZE;
+	for (int y = 0; y < COLOR_LUT_SIZE; y++) {
+	    for (int x = 0; x < COLOR_LUT_SIZE; x++) {
+		float fx = (x + 0.5f) * scale - COLOR_LUT_RANGE;
+		float fy = (y + 0.5f) * scale - COLOR_LUT_RANGE;
+		computeColorPixel(fx, fy, 1.0f, bgr[y * COLOR_LUT_SIZE + x]);
+	    }
+	}
+    }
+};
+
+// built on first use, then shared by all threads and frames
+static const CColorLUT& colorLUT()
+{
+    static const CColorLUT *lut = new CColorLUT;
+    return *lut;
+}
+
+void computeColorRowLUT(const float *uv, uchar *pix, int n, float maxrad)
+{
+    const uchar (*bgr)[3] = colorLUT().bgr;
+    const float half = COLOR_LUT_SIZE / 2;
+    const float edge = half - 0.5f; // center of the outermost cells
+    const float scale = half / (COLOR_LUT_RANGE * maxrad);
+    for (int i = 0; i < n; i++, uv += 2, pix += 3) {
+	float u = uv[0], v = uv[1];
+	if (fabsf(u) > (float)UNKNOWN_FLOW_THRESH || fabsf(v) > (float)UNKNOWN_FLOW_THRESH ||
+	    u != u || v != v) {
+	    pix[0] = pix[1] = pix[2] = 0;
+	    continue;
+	}
+	float gx = u * scale, gy = v * scale;
+	float m = fabsf(gx) > fabsf(gy) ? fabsf(gx) : fabsf(gy);
+	if (m > edge) { // clamp to the table along the flow direction
+	    gx *= edge / m;
+	    gy *= edge / m;
+	}
+	int x = (int)(gx + half), y = (int)(gy + half);
+	const uchar *c = bgr[y * COLOR_LUT_SIZE + x];
+	pix[0] = c[0];
+	pix[1] = c[1];
+	pix[2] = c[2];
+    }
+}
@@ -1 +1,12 @@
 void computeColor(float fx, float fy, uchar *pix);
+
+// color-code n interleaved (u, v) flow vectors normalized by maxrad into
+// 3-band BGR pixels; unknown flow (see flowStats.h) is colored black.
+// Vectorized with SSE2/AVX2 where available; all versions give identical
+// bytes, within one level of computeColor (atan2 is approximated)
+void computeColorRow(const float *uv, uchar *pix, int n, float maxrad);
+
+// same, quantized: looks the colors up in a table (built once per process)
+// over the normalized flow; faster, within 1 level of computeColorRow
+// except next to the rad = 1 circle (see colorcode.cpp)
+void computeColorRowLUT(const float *uv, uchar *pix, int n, float maxrad);
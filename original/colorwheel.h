@@ -0,0 +1,75 @@
+// colorwheel.h
+//
+// The color wheel used for color-coding flow vectors (see colorcode.cpp),
+// generated at compile time.  Shared with colorflow's FlowImage; no
+// imageLib dependency.
+//
+// The entries are the ones makecolorwheel used to compute at run time,
+// pre-normalized to [0, 1] and stored one array per band (R, G, B).
+// Entry ncols repeats entry 0, so that interpolating between entries
+// k0 and k0 + 1 never needs a modulo.
+
+#ifndef COLORWHEEL_H
+#define COLORWHEEL_H
+
+struct CColorWheel
+{
+    // relative lengths of color transitions:
+    // these are chosen based on perceptual similarity
+    // (e.g. one can distinguish more shades between red and yellow
+    //  than between yellow and green)
+    static constexpr int RY = 15;
+    static constexpr int YG = 6;
+    static constexpr int GC = 4;
+    static constexpr int CB = 11;
+    static constexpr int BM = 13;
+    static constexpr int MR = 6;
+    static constexpr int ncols = RY + YG + GC + CB + BM + MR;
+
+    // band b (0 = R, 1 = G, 2 = B) of entry k in 0..255
+    static constexpr int color(int k, int b)
+    {
+	return k >= ncols ? color(k - ncols, b) :
+	    b == 0 ? red(k) : b == 1 ? green(k) : blue(k);
+    }
+
+private:
+    static constexpr int red(int k)
+    {
+	return k < RY ? 255 :
+	    k < RY+YG ? 255 - 255*(k-RY)/YG :
+	    k < RY+YG+GC+CB ? 0 :
+	    k < RY+YG+GC+CB+BM ? 255*(k-RY-YG-GC-CB)/BM : 255;
+    }
+    static constexpr int green(int k)
+    {
+	return k < RY ? 255*k/RY :
+	    k < RY+YG+GC ? 255 :
+	    k < RY+YG+GC+CB ? 255 - 255*(k-RY-YG-GC)/CB : 0;
+    }
+    static constexpr int blue(int k)
+    {
+	return k < RY+YG ? 0 :
+	    k < RY+YG+GC ? 255*(k-RY-YG)/GC :
+	    k < RY+YG+GC+CB+BM ? 255 : 255 - 255*(k-RY-YG-GC-CB-BM)/MR;
+    }
+};
+
+// expand the table from the index pack 0 .. ncols (C++11 has no index_sequence)
+template <int... K> struct CColorWheelTable
+{
+    static constexpr float band[3][sizeof...(K)] = {
+	{ CColorWheel::color(K, 0) / 255.0f ... },
+	{ CColorWheel::color(K, 1) / 255.0f ... },
+	{ CColorWheel::color(K, 2) / 255.0f ... } };
+};
+template <int... K> constexpr float CColorWheelTable<K...>::band[3][sizeof...(K)];
+
+template <int N, int... K> struct CColorWheelBuild : CColorWheelBuild<N - 1, N - 1, K...> {};
+template <int... K> struct CColorWheelBuild<0, K...> { typedef CColorWheelTable<K...> table; };
+
+// colorwheelf[b][k]: band b of entry k, k = 0 .. CColorWheel::ncols
+static constexpr const float (&colorwheelf)[3][CColorWheel::ncols + 1] =
+    CColorWheelBuild<CColorWheel::ncols + 1>::table::band;
+
+#endif // COLORWHEEL_H
@@ -31,6 +31,16 @@
 #include "imageLib.h"
 #include "flowIO.h"
 
+#include <sys/stat.h>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 // return whether flow vector is unknown
 bool unknown_flow(float u, float v) {
     return (fabs(u) >  UNKNOWN_FLOW_THRESH) 
@@ -42,8 +52,118 @@ bool unknown_flow(float *f) {
     return unknown_flow(f[0], f[1]);
 }
 
-// read a flow file into 2-band image
-void ReadFlowFile(CFloatImage& img, const char* filename)
+// largest width or height accepted by the readers
+static int flowMaxDimension = 99999;
+
+void SetFlowMaxDimension(int maxDimension)
+{
+    flowMaxDimension = maxDimension;
+}
+
+int GetFlowMaxDimension()
+{
+    return flowMaxDimension;
+}
+
+// check the header fields of a flow file
+static void CheckFlowHeader(float tag, int width, int height, const char* filename)
+{
+    if (tag != TAG_FLOAT) // simple test for correct endian-ness
+	throw CError("ReadFlowFile(%s): wrong tag (possibly due to big-endian machine?)", filename);
+
+    // another sanity check to see that integers were read correctly (99999 should do the trick...)
+    if (width < 1 || width > flowMaxDimension)
+	throw CError("ReadFlowFile(%s): illegal width %d", filename, width);
+
+    if (height < 1 || height > flowMaxDimension)
+	throw CError("ReadFlowFile(%s): illegal height %d", filename, height);
+}
+
+// whether the rows of an image are packed without padding, so that
+// the whole image can be transferred with a single fread/fwrite
+static bool RowsArePacked(const CFloatImage& img)
+{
+    CShape sh = img.Shape();
+    return sh.height < 2 ||
+	&img.Pixel(0, 1, 0) - &img.Pixel(0, 0, 0) == (ptrdiff_t) sh.width * sh.nBands;
+}
+
+// size of an open file in bytes
+static size_t FlowFileSize(FILE *stream)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_fstat64(_fileno(stream), &st) != 0)
+	return 0;
+#else
+    struct stat st;
+    if (fstat(fileno(stream), &st) != 0)
+	return 0;
+#endif
+    return (size_t) st.st_size;
+}
+
+// read only the 12-byte header of a flow file and check it against the file size
+CFlowHeader ReadFlowHeader(const char* filename)
+{
+    if (filename == NULL)
+	throw CError("ReadFlowHeader: empty filename");
+
+    const char *dot = strrchr(filename, '.');
+    if (dot == NULL || strcmp(dot, ".flo") != 0)
+	throw CError("ReadFlowHeader (%s): extension .flo expected", filename);
+
+    FILE *stream = fopen(filename, "rb");
+    if (stream == 0)
+        throw CError("ReadFlowHeader: could not open %s", filename);
+
+    int width, height;
+    float tag;
+
+    if ((int)fread(&tag,    sizeof(float), 1, stream) != 1 ||
+	(int)fread(&width,  sizeof(int),   1, stream) != 1 ||
+	(int)fread(&height, sizeof(int),   1, stream) != 1) {
+	fclose(stream);
+	throw CError("ReadFlowHeader: problem reading file %s", filename);
+    }
+    size_t fileBytes = FlowFileSize(stream);
+    fclose(stream);
+
+    CheckFlowHeader(tag, width, height, filename);
+
+    CFlowHeader header;
+    header.width = width;
+    header.height = height;
+    header.nBytes = 12 + (size_t) 2 * width * height * sizeof(float);
+    header.valid = true;
+
+    if (fileBytes < header.nBytes)
+	throw CError("ReadFlowHeader(%s): file is too short", filename);
+    if (fileBytes > header.nBytes)
+	throw CError("ReadFlowHeader(%s): file is too long", filename);
+
+    return header;
+}
+
+// probe many flow files; does not throw, invalid files are marked in the result
+void ReadFlowHeaders(const std::vector<std::string>& filenames,
+		     std::vector<CFlowHeader>& headers)
+{
+    headers.resize(filenames.size());
+    for (size_t i = 0; i < filenames.size(); i++) {
+	try {
+	    headers[i] = ReadFlowHeader(filenames[i].c_str());
+	}
+	catch (CError &) {
+	    headers[i].width = headers[i].height = 0;
+	    headers[i].nBytes = 0;
+	    headers[i].valid = false;
+	}
+    }
+}
+
+// read a flow file into 2-band image, optionally accumulating statistics per row
+static void ReadFlowFileRows(CFloatImage& img, const char* filename, CFlowStats* stats)
 {
     if (filename == NULL)
 	throw CError("ReadFlowFile: empty filename");
@@ -64,15 +184,7 @@ void ReadFlowFile(CFloatImage& img, const char* filename)
 	(int)fread(&height, sizeof(int),   1, stream) != 1)
 	throw CError("ReadFlowFile: problem reading file %s", filename);
 
-    if (tag != TAG_FLOAT) // simple test for correct endian-ness
-	throw CError("ReadFlowFile(%s): wrong tag (possibly due to big-endian machine?)", filename);
-
-    // another sanity check to see that integers were read correctly (99999 should do the trick...)
-    if (width < 1 || width > 99999)
-	throw CError("ReadFlowFile(%s): illegal width %d", filename, width);
-
-    if (height < 1 || height > 99999)
-	throw CError("ReadFlowFile(%s): illegal height %d", filename, height);
+    CheckFlowHeader(tag, width, height, filename);
 
     int nBands = 2;
     CShape sh(width, height, nBands);
@@ -80,10 +192,20 @@ void ReadFlowFile(CFloatImage& img, const char* filename)
 
     //printf("reading %d x %d x 2 = %d floats\n", width, height, width*height*2);
     int n = nBands * width;
-    for (int y = 0; y < height; y++) {
-	float* ptr = &img.Pixel(0, y, 0);
-	if ((int)fread(ptr, sizeof(float), n, stream) != n)
+    if (stats == NULL && RowsArePacked(img)) {
+	size_t nAll = (size_t) n * height;
+	if (fread(&img.Pixel(0, 0, 0), sizeof(float), nAll, stream) != nAll)
 	    throw CError("ReadFlowFile(%s): file is too short", filename);
+    } else {
+	if (stats)
+	    stats->Clear();
+	for (int y = 0; y < height; y++) {
+	    float* ptr = &img.Pixel(0, y, 0);
+	    if ((int)fread(ptr, sizeof(float), n, stream) != n)
+		throw CError("ReadFlowFile(%s): file is too short", filename);
+	    if (stats)		// the row is still in cache
+		stats->AddRow(ptr, width);
+	}
     }
 
     if (fgetc(stream) != EOF)
@@ -92,8 +214,191 @@ void ReadFlowFile(CFloatImage& img, const char* filename)
     fclose(stream);
 }
 
+// read a flow file into 2-band image
+void ReadFlowFile(CFloatImage& img, const char* filename)
+{
+    ReadFlowFileRows(img, filename, NULL);
+}
+
+// read a flow file and compute its motion range statistics while the rows are read
+void ReadFlowFile(CFloatImage& img, const char* filename, CFlowStats& stats)
+{
+    ReadFlowFileRows(img, filename, &stats);
+}
+
+// add the motion range statistics of rows [0, nRows), one partial result per
+// thread chunk, merged in chunk order
+void AddFlowStats(const CFloatImage& img, CFlowStats& stats, int nRows)
+{
+    CShape sh = img.Shape();
+    if (sh.nBands != 2)
+	throw CError("AddFlowStats: image must have 2 bands");
+    if (nRows < 0 || nRows > sh.height)
+	nRows = sh.height;
+    int nChunks = ParallelChunkCount(nRows);
+    std::vector<CFlowStats> partial(nChunks);
+    ParallelForChunks(0, nRows, nChunks, [&](int chunk, int lo, int hi) {
+	for (int y = lo; y < hi; y++)
+	    partial[chunk].AddRow(&img.Pixel(0, y, 0), sh.width);
+    });
+    for (size_t i = 0; i < partial.size(); i++)
+	stats.Merge(partial[i]);
+}
+
+// sequential reader for flow files that are too large to be held in memory
+CFlowReader::CFlowReader(const char* filename)
+{
+    CFlowHeader header = ReadFlowHeader(filename);   // checks name, header and size
+    m_filename = filename;
+    m_shape = CShape(header.width, header.height, 2);
+    m_stream = fopen(filename, "rb");
+    if (m_stream == 0)
+        throw CError("ReadFlowFile: could not open %s", filename);
+    Rewind();
+}
+
+CFlowReader::~CFlowReader()
+{
+    if (m_stream)
+	fclose(m_stream);
+}
+
+CShape CFlowReader::Shape()
+{
+    return m_shape;
+}
+
+int CFlowReader::ReadRows(CFloatImage& band, int nRows)
+{
+    band.ReAllocate(CShape(m_shape.width, nRows, m_shape.nBands));
+    int rows = __min(nRows, m_shape.height - m_row);
+    int n = m_shape.nBands * m_shape.width;
+    for (int y = 0; y < rows; y++) {
+	float* ptr = &band.Pixel(0, y, 0);
+	if ((int)fread(ptr, sizeof(float), n, m_stream) != n)
+	    throw CError("ReadFlowFile(%s): file is too short", m_filename.c_str());
+    }
+    m_row += rows;
+    return rows;
+}
+
+void CFlowReader::Rewind()
+{
+    if (fseek(m_stream, 12, SEEK_SET) != 0)
+	throw CError("ReadFlowFile: problem reading file %s", m_filename.c_str());
+    m_row = 0;
+}
+
+// private mapping of a whole flow file, owned by the image that wraps it
+struct CFlowMapping
+{
+    void *base;		// start of the mapped view
+    size_t length;	// length of the mapped view in bytes
+};
+
+// delete function handed to CImage: unmap the file once the last reference is gone
+static void UnmapFlowFile(void *ptr)
+{
+    CFlowMapping *map = (CFlowMapping *) ptr;
+#ifdef _WIN32
+    UnmapViewOfFile(map->base);
+#else
+    munmap(map->base, map->length);
+#endif
+    delete map;
+}
+
+// map a file copy-on-write, so that the image can be modified without touching the file
+static CFlowMapping *MapFlowFile(const char* filename)
+{
+    CFlowMapping *map = new CFlowMapping;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+			      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+	delete map;
+	throw CError("ReadFlowFile: could not open %s", filename);
+    }
+    LARGE_INTEGER size;
+    if (! GetFileSizeEx(file, &size) || size.QuadPart < 12) {
+	CloseHandle(file);
+	delete map;
+	throw CError("ReadFlowFile: problem reading file %s", filename);
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    map->base = mapping ? MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0) : NULL;
+    map->length = (size_t) size.QuadPart;
+    if (mapping)
+	CloseHandle(mapping);	// the view keeps the mapping alive
+    if (map->base == NULL) {
+	delete map;
+	throw CError("ReadFlowFile: could not map %s", filename);
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+	delete map;
+	throw CError("ReadFlowFile: could not open %s", filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12) {
+	close(fd);
+	delete map;
+	throw CError("ReadFlowFile: problem reading file %s", filename);
+    }
+    map->length = (size_t) st.st_size;
+    map->base = mmap(NULL, map->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);			// the mapping keeps the file alive
+    if (map->base == MAP_FAILED) {
+	delete map;
+	throw CError("ReadFlowFile: could not map %s", filename);
+    }
+#endif
+    return map;
+}
+
+// map a flow file into memory and wrap its payload as a 2-band image (no copy)
+void ReadFlowFileMapped(CFloatImage& img, const char* filename)
+{
+    if (filename == NULL)
+	throw CError("ReadFlowFile: empty filename");
+
+    const char *dot = strrchr(filename, '.');
+    if (dot == NULL || strcmp(dot, ".flo") != 0)
+	throw CError("ReadFlowFile (%s): extension .flo expected", filename);
+
+    CFlowMapping *map = MapFlowFile(filename);
+    char *base = (char *) map->base;
+
+    int width, height;
+    float tag;
+    memcpy(&tag,    base + 0, sizeof(float));
+    memcpy(&width,  base + 4, sizeof(int));
+    memcpy(&height, base + 8, sizeof(int));
+
+    int nBands = 2;
+    try {
+	CheckFlowHeader(tag, width, height, filename);
+	size_t n = (size_t) nBands * width * height * sizeof(float);
+	if (map->length < 12 + n)
+	    throw CError("ReadFlowFile(%s): file is too short", filename);
+	if (map->length > 12 + n)
+	    throw CError("ReadFlowFile(%s): file is too long", filename);
+    }
+    catch (CError &) {
+	UnmapFlowFile(map);
+	throw;
+    }
+
+    // the payload starts right after the 12-byte header, rows are packed
+    CShape sh(width, height, nBands);
+    img.ReAllocate(sh, (float *) (base + 12), true, nBands * width * sizeof(float),
+		   UnmapFlowFile, map);
+}
+
 // write a 2-band image into flow file 
-void WriteFlowFile(CFloatImage img, const char* filename)
+void WriteFlowFile(const CFloatImage& img, const char* filename)
 {
     if (filename == NULL)
 	throw CError("WriteFlowFile: empty filename");
@@ -123,11 +428,17 @@ void WriteFlowFile(CFloatImage img, const char* filename)
 
     // write the rows
     int n = nBands * width;
-    for (int y = 0; y < height; y++) {
-	float* ptr = &img.Pixel(0, y, 0);
-	if ((int)fwrite(ptr, sizeof(float), n, stream) != n)
-	    throw CError("WriteFlowFile(%s): problem writing data", filename); 
-   }
+    if (RowsArePacked(img)) {
+	size_t nAll = (size_t) n * height;
+	if (fwrite(&img.Pixel(0, 0, 0), sizeof(float), nAll, stream) != nAll)
+	    throw CError("WriteFlowFile(%s): problem writing data", filename);
+    } else {
+	for (int y = 0; y < height; y++) {
+	    const float* ptr = &img.Pixel(0, y, 0);
+	    if ((int)fwrite(ptr, sizeof(float), n, stream) != n)
+		throw CError("WriteFlowFile(%s): problem writing data", filename); 
+	}
+    }
 
     fclose(stream);
 }
@@ -1,20 +1,71 @@
 // flowIO.h
 
-// the "official" threshold - if the absolute value of either 
-// flow component is greater, it's considered unknown
-#define UNKNOWN_FLOW_THRESH 1e9
-
-// value to use to represent unknown flow
-#define UNKNOWN_FLOW 1e10
+#include <string>
+#include <vector>
+#include "flowStats.h"	// UNKNOWN_FLOW_THRESH, UNKNOWN_FLOW, CFlowStats
 
 // return whether flow vector is unknown
 bool unknown_flow(float u, float v);
 bool unknown_flow(float *f);
 
+// largest width or height the readers accept (default 99999);
+// the limit guards against garbage headers, raise it for huge mosaics
+void SetFlowMaxDimension(int maxDimension);
+int GetFlowMaxDimension();
+
+// header information of a flow file
+struct CFlowHeader
+{
+    int width, height;	// dimensions of the (2-band) flow
+    size_t nBytes;	// expected file size: 12-byte header + width*height*2 floats
+    bool valid;		// header is sane and the file has the expected size;
+			// only false in ReadFlowHeaders results
+};
+
+// read only the 12-byte header of a flow file and check it against the file size;
+// throws CError on any problem, so a returned header is always valid
+CFlowHeader ReadFlowHeader(const char* filename);
+
+// probe many flow files; does not throw, invalid files are marked in the result
+void ReadFlowHeaders(const std::vector<std::string>& filenames,
+		     std::vector<CFlowHeader>& headers);
+
 // read a flow file into 2-band image
 void ReadFlowFile(CFloatImage& img, const char* filename);
 
+// read a flow file and compute its motion range statistics while the rows are read
+void ReadFlowFile(CFloatImage& img, const char* filename, CFlowStats& stats);
+
+// add the motion range statistics of the first nRows rows (all if < 0) of a
+// 2-band image to stats; vectorized, and split across ThreadCount() threads
+void AddFlowStats(const CFloatImage& img, CFlowStats& stats, int nRows = -1);
+
+// sequential reader for flow files that are too large to be held in memory:
+// the rows are read in bands of a few rows each
+class CFlowReader
+{
+public:
+    CFlowReader(const char* filename);	// open the file and check its header
+    ~CFlowReader();
+    CFlowReader(const CFlowReader&) = delete;		// owns the open stream
+    CFlowReader& operator=(const CFlowReader&) = delete;
+    CShape Shape();			// width x height x 2
+    int ReadRows(CFloatImage& band, int nRows);
+	// read the next (up to) nRows rows into band (reallocated to nRows rows);
+	// returns the number of rows read, 0 at the end of the file
+    void Rewind();			// go back to the first row
+private:
+    std::string m_filename;
+    FILE *m_stream;
+    CShape m_shape;
+    int m_row;				// next row to be read
+};
+
+// map a flow file into memory and wrap its payload as a 2-band image (no copy);
+// the mapping is private (copy-on-write) and is released with the last reference
+void ReadFlowFileMapped(CFloatImage& img, const char* filename);
+
 // write a 2-band image into flow file 
-void WriteFlowFile(CFloatImage img, const char* filename);
+void WriteFlowFile(const CFloatImage& img, const char* filename);
 
 
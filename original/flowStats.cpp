@@ -0,0 +1,132 @@
+// flowStats.cpp
+//
+// motion range statistics of a 2-band flow, accumulated row by row
+
+#include <math.h>
+#include "flowStats.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLOWSTATS_SSE2
+#include <emmintrin.h>
+#endif
+
+void CFlowStats::Clear()
+{
+    minu = minv =  1e10;
+    maxu = maxv = -1e10;
+    maxrad = -1;
+    nUnknown = 0;
+    nKnown = 0;
+    sumrad = 0;
+}
+
+// The largest magnitude is found on the squared radius, with a single
+// sqrt per row; sqrt is monotonic and correctly rounded, so the result
+// is the same as taking the largest sqrt.
+
+#ifdef FLOWSTATS_SSE2
+static inline float hmin(__m128 a)
+{
+    a = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+    a = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(a);
+}
+
+static inline float hmax(__m128 a)
+{
+    a = _mm_max_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+    a = _mm_max_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(a);
+}
+
+static inline float hsum(__m128 a)
+{
+    a = _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+    a = _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(a);
+}
+#endif
+
+void CFlowStats::AddRow(const float *uv, int width)
+{
+    float rad2max = -1;
+    float rowsum = 0;
+    int x = 0;
+
+#ifdef FLOWSTATS_SSE2
+    // 4 vectors per iteration; unknown lanes are replaced by the neutral
+    // element of each reduction, using the mask of known lanes
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 thresh = _mm_set1_ps((float)UNKNOWN_FLOW_THRESH);
+    const __m128 big = _mm_set1_ps(1e10f);
+    const __m128 small = _mm_set1_ps(-1e10f);
+    __m128 vminu = big, vmaxu = small, vminv = big, vmaxv = small;
+    __m128 vrad2 = _mm_set1_ps(-1), vsum = _mm_setzero_ps();
+    static const int nBits4[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    int known = 0;
+    for (; x + 4 <= width; x += 4) {
+	__m128 a0 = _mm_loadu_ps(uv + 2 * x);
+	__m128 a1 = _mm_loadu_ps(uv + 2 * x + 4);
+	__m128 u = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 v = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1));
+	// false for NaN, too, like unknown_flow()
+	__m128 ok = _mm_and_ps(_mm_cmple_ps(_mm_and_ps(u, absMask), thresh),
+			       _mm_cmple_ps(_mm_and_ps(v, absMask), thresh));
+	known += nBits4[_mm_movemask_ps(ok)];
+	vminu = _mm_min_ps(vminu, _mm_or_ps(_mm_and_ps(ok, u), _mm_andnot_ps(ok, big)));
+	vmaxu = _mm_max_ps(vmaxu, _mm_or_ps(_mm_and_ps(ok, u), _mm_andnot_ps(ok, small)));
+	vminv = _mm_min_ps(vminv, _mm_or_ps(_mm_and_ps(ok, v), _mm_andnot_ps(ok, big)));
+	vmaxv = _mm_max_ps(vmaxv, _mm_or_ps(_mm_and_ps(ok, v), _mm_andnot_ps(ok, small)));
+	__m128 rad2 = _mm_and_ps(ok, _mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(v, v)));
+	vrad2 = _mm_max_ps(vrad2, rad2);
+	vsum = _mm_add_ps(vsum, _mm_sqrt_ps(rad2));
+    }
+    if (x > 0) {
+	float m;
+	if ((m = hmin(vminu)) < minu) minu = m;
+	if ((m = hmax(vmaxu)) > maxu) maxu = m;
+	if ((m = hmin(vminv)) < minv) minv = m;
+	if ((m = hmax(vmaxv)) > maxv) maxv = m;
+	if (known > 0 && (m = hmax(vrad2)) > rad2max) rad2max = m;
+	rowsum = hsum(vsum);
+	nKnown += known;
+	nUnknown += x - known;
+    }
+#endif
+
+    for (; x < width; x++) {
+	float fx = uv[2 * x];
+	float fy = uv[2 * x + 1];
+	// same test as unknown_flow() in flowIO.cpp
+	if (fabs(fx) > UNKNOWN_FLOW_THRESH || fabs(fy) > UNKNOWN_FLOW_THRESH ||
+	    isnan(fx) || isnan(fy)) {
+	    nUnknown++;
+	    continue;
+	}
+	if (fx < minu) minu = fx;
+	if (fx > maxu) maxu = fx;
+	if (fy < minv) minv = fy;
+	if (fy > maxv) maxv = fy;
+	float rad2 = fx * fx + fy * fy;
+	if (rad2 > rad2max) rad2max = rad2;
+	rowsum += sqrtf(rad2);
+	nKnown++;
+    }
+    if (rad2max >= 0) {
+	float rad = sqrtf(rad2max);
+	if (rad > maxrad) maxrad = rad;
+    }
+    sumrad += rowsum;
+}
+
+void CFlowStats::Merge(const CFlowStats& s)
+{
+    if (s.minu < minu) minu = s.minu;
+    if (s.maxu > maxu) maxu = s.maxu;
+    if (s.minv < minv) minv = s.minv;
+    if (s.maxv > maxv) maxv = s.maxv;
+    if (s.maxrad > maxrad) maxrad = s.maxrad;
+    nUnknown += s.nUnknown;
+    nKnown += s.nKnown;
+    sumrad += s.sumrad;
+}
@@ -0,0 +1,44 @@
+// flowStats.h
+//
+// motion range statistics of a 2-band flow, accumulated row by row
+// (no dependency on imageLib, so that it can be shared with colorflow)
+
+#ifndef FLOW_STATS_H
+#define FLOW_STATS_H
+
+#include <stddef.h>
+
+// the "official" threshold - if the absolute value of either 
+// flow component is greater, it's considered unknown
+#define UNKNOWN_FLOW_THRESH 1e9
+
+// value to use to represent unknown flow
+#define UNKNOWN_FLOW 1e10
+
+struct CFlowStats
+{
+    float minu, maxu;	// range of the horizontal component
+    float minv, maxv;	// range of the vertical component
+    float maxrad;	// largest motion magnitude (-1 if there is no known flow)
+    size_t nUnknown;	// number of unknown flow vectors
+    size_t nKnown;	// number of known flow vectors
+    double sumrad;	// sum of their magnitudes
+
+    // mean motion magnitude (0 if there is no known flow)
+    float MeanRad() const { return nKnown ? (float)(sumrad / nKnown) : 0; }
+
+    CFlowStats() { Clear(); }
+
+    // reset to the statistics of an empty flow
+    void Clear();
+
+    // accumulate one row of interleaved u, v values
+    // (vectorized with SSE2 where available; maxrad is exact either way,
+    // sumrad may differ in the last bits between the two versions)
+    void AddRow(const float *uv, int width);
+
+    // combine with the statistics of other rows
+    void Merge(const CFlowStats& s);
+};
+
+#endif
@@ -17,44 +17,243 @@
 #include "Image.h"
 #include "Error.h"
 #include "Convert.h"
+#include <math.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
 
 //
 // Type conversion utilities
 //
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CONVERT_SSE2
+#include <emmintrin.h>
+#endif
+
+static inline int RoundToInt(float v)
+{
+    // round to nearest, ties to even (like _mm_cvtps_epi32)
+#ifdef CONVERT_SSE2
+    return _mm_cvtss_si32(_mm_set_ss(v));
+#else
+    return (int) lrintf(v);
+#endif
+}
+
+static inline float FromFloat(float v, float*, bool)     { return v; }
+static inline int   FromFloat(float v, int*, bool round)
+{
+    return (round) ? RoundToInt(v) : (int) v;
+}
+static inline uchar FromFloat(float v, uchar*, bool round)
+{
+    return (uchar) ((round) ? RoundToInt(v) : (int) v);
+}
+
+#ifdef CONVERT_SSE2
+
+// Load and store 16 values at a time, as four vectors of floats or of
+// 32-bit integers.  The conversions do what the scalar casts do: float
+// to int truncates (or rounds), int to uchar keeps the low byte.
+
+static inline void Load16(const int* p, __m128i v[4])
+{
+    for (int k = 0; k < 4; k++)
+        v[k] = _mm_loadu_si128((const __m128i *) &p[4*k]);
+}
+
+static inline void Load16(const uchar* p, __m128i v[4])
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i b  = _mm_loadu_si128((const __m128i *) p);
+    __m128i lo = _mm_unpacklo_epi8(b, zero);
+    __m128i hi = _mm_unpackhi_epi8(b, zero);
+    v[0] = _mm_unpacklo_epi16(lo, zero);
+    v[1] = _mm_unpackhi_epi16(lo, zero);
+    v[2] = _mm_unpacklo_epi16(hi, zero);
+    v[3] = _mm_unpackhi_epi16(hi, zero);
+}
+
+static inline void Load16(const float* p, __m128 v[4])
+{
+    for (int k = 0; k < 4; k++)
+        v[k] = _mm_loadu_ps(&p[4*k]);
+}
+
+template <class T>
+static inline void Load16(const T* p, __m128 v[4])
+{
+    __m128i w[4];
+    Load16(p, w);
+    for (int k = 0; k < 4; k++)
+        v[k] = _mm_cvtepi32_ps(w[k]);
+}
+
+static inline void Store16(int* p, const __m128i v[4])
+{
+    for (int k = 0; k < 4; k++)
+        _mm_storeu_si128((__m128i *) &p[4*k], v[k]);
+}
+
+static inline void Store16(uchar* p, const __m128i v[4])
+{
+    __m128i mask = _mm_set1_epi32(0xff);
+    __m128i lo = _mm_packs_epi32(_mm_and_si128(v[0], mask), _mm_and_si128(v[1], mask));
+    __m128i hi = _mm_packs_epi32(_mm_and_si128(v[2], mask), _mm_and_si128(v[3], mask));
+    _mm_storeu_si128((__m128i *) p, _mm_packus_epi16(lo, hi));
+}
+
+static inline void Store16(float* p, const __m128 v[4], bool)
+{
+    for (int k = 0; k < 4; k++)
+        _mm_storeu_ps(&p[4*k], v[k]);
+}
+
+template <class T>
+static inline void Store16(T* p, const __m128 v[4], bool round)
+{
+    __m128i w[4];
+    for (int k = 0; k < 4; k++)
+        w[k] = (round) ? _mm_cvtps_epi32(v[k]) : _mm_cvttps_epi32(v[k]);
+    Store16(p, w);
+}
+
+// __max and __min for 32-bit integers (SSE2 only has them for 16 bits)
+
+static inline __m128i Max4i(__m128i a, __m128i b)
+{
+    __m128i gt = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+
+static inline __m128i Min4i(__m128i a, __m128i b)
+{
+    __m128i lt = _mm_cmplt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(lt, a), _mm_andnot_si128(lt, b));
+}
+
+#endif // CONVERT_SSE2
+
+// The line loops, with the choices made by ScaleAndOffsetLine as template
+// arguments.  FloatLine computes in float (all pairs with a float type,
+// and scaling); IntLine clips and converts between uchar and int.
+// Both give exactly the results of the scalar code, with or without SSE2:
+// _mm_max_ps(v, lo) is v > lo ? v : lo, as __max(v, lo) is.
+
+template <class T1, class T2, bool SCALE, bool CLIP, bool ROUND>
+static void FloatLine(const T1* src, T2* dst, int n,
+                      float scale, float offset, float minVal, float maxVal)
+{
+    int i = 0;
+#ifdef CONVERT_SSE2
+    __m128 s = _mm_set1_ps(scale), o = _mm_set1_ps(offset);
+    __m128 lo = _mm_set1_ps(minVal), hi = _mm_set1_ps(maxVal);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128 v[4];
+        Load16(&src[i], v);
+        for (int k = 0; k < 4; k++)
+        {
+            if (SCALE)
+                v[k] = _mm_add_ps(_mm_mul_ps(v[k], s), o);
+            if (CLIP)
+                v[k] = _mm_min_ps(_mm_max_ps(v[k], lo), hi);
+        }
+        Store16(&dst[i], v, ROUND);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        float val = (float) src[i];
+        if (SCALE)
+            val = val * scale + offset;
+        if (CLIP)
+            val = __min(__max(val, minVal), maxVal);
+        dst[i] = FromFloat(val, dst, ROUND);
+    }
+}
+
+template <class T1, class T2, bool CLIP>
+static void IntLine(const T1* src, T2* dst, int n, int minVal, int maxVal)
+{
+    int i = 0;
+#ifdef CONVERT_SSE2
+    __m128i lo = _mm_set1_epi32(minVal), hi = _mm_set1_epi32(maxVal);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v[4];
+        Load16(&src[i], v);
+        if (CLIP)
+            for (int k = 0; k < 4; k++)
+                v[k] = Min4i(Max4i(v[k], lo), hi);
+        Store16(&dst[i], v);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        int val = src[i];
+        if (CLIP)
+            val = __min(__max(val, minVal), maxVal);
+        dst[i] = (T2) val;
+    }
+}
+
+template <class T1, class T2, bool SCALE>
+static void FloatLine(const T1* src, T2* dst, int n, float scale, float offset,
+                      bool clip, bool round, T2 minVal, T2 maxVal)
+{
+    if (clip && round)
+        FloatLine<T1, T2, SCALE, true, true>(src, dst, n, scale, offset, minVal, maxVal);
+    else if (clip)
+        FloatLine<T1, T2, SCALE, true, false>(src, dst, n, scale, offset, minVal, maxVal);
+    else if (round)
+        FloatLine<T1, T2, SCALE, false, true>(src, dst, n, scale, offset, minVal, maxVal);
+    else
+        FloatLine<T1, T2, SCALE, false, false>(src, dst, n, scale, offset, minVal, maxVal);
+}
+
+// clip and/or convert without scaling: in integers if both types are
 template <class T1, class T2>
-extern void ScaleAndOffsetLine(T1* src, T2* dst, int n,
+static void ClipLine(const T1* src, T2* dst, int n, bool clip, bool round,
+                     T2 minVal, T2 maxVal, std::false_type /*integer types*/)
+{
+    FloatLine<T1, T2, false>(src, dst, n, 1.0f, 0.0f, clip, round, minVal, maxVal);
+}
+
+template <class T1, class T2>
+static void ClipLine(const T1* src, T2* dst, int n, bool clip, bool /*round*/,
+                     T2 minVal, T2 maxVal, std::true_type /*integer types*/)
+{
+    if (clip)
+        IntLine<T1, T2, true>(src, dst, n, minVal, maxVal);
+    else
+        IntLine<T1, T2, false>(src, dst, n, minVal, maxVal);
+}
+
+template <class T1, class T2>
+extern void ScaleAndOffsetLine(const T1* src, T2* dst, int n,
                         float scale, float offset,
-                        T2 minVal, T2 maxVal)
+                        T2 minVal, T2 maxVal, bool round)
 {
-    // This routine does NOT round values when converting from float to int
+    // This routine does NOT round values when converting from float to int,
+    // unless round is set (to nearest, ties to even)
     const bool scaleOffset = (scale != 1.0f) || (offset != 0.0f);
     const bool clip = (minVal < maxVal);
+    typedef std::integral_constant<bool, std::is_integral<T1>::value &&
+                                         std::is_integral<T2>::value> IntegerTypes;
 
     if (scaleOffset)
-        for (int i = 0; i < n; i++)
-        {
-            float val = src[i] * scale + offset;
-            if (clip)
-                val = __min(__max(val, minVal), maxVal);
-            dst[i] = (T2) val;
-        }
-    else if (clip)
-        for (int i = 0; i < n; i++)
-        {
-            dst[i] = (T2) __min(__max(src[i], minVal), maxVal);
-        }
-    else if (typeid(T1) == typeid(T2))
+        FloatLine<T1, T2, true>(src, dst, n, scale, offset, clip, round, minVal, maxVal);
+    else if (!clip && std::is_same<T1, T2>::value)
         memcpy(dst, src, n*sizeof(T2));
     else
-        for (int i = 0; i < n; i++)
-        {
-            dst[i] = (T2) src[i];
-        }
+        ClipLine(src, dst, n, clip, round, minVal, maxVal, IntegerTypes());
 }
 
 template <class T1, class T2>
-extern void ScaleAndOffset(CImageOf<T1>& src, CImageOf<T2>& dst, float scale, float offset)
+extern void ScaleAndOffset(const CImageOf<T1>& src, CImageOf<T2>& dst, float scale, float offset,
+                           bool round)
 {
     // Convert between images of same shape but diffent types,
     //  and optionally scale and/or offset the pixel values
@@ -81,12 +280,412 @@ extern void ScaleAndOffset(CImageOf<T1>& src, CImageOf<T2>& dst, float scale, fl
     {
         int n = sShape.width * sShape.nBands;
         ScaleAndOffsetLine(&src.Pixel(0, y, 0), &dst.Pixel(0, y, 0),
-                           n, scale, offset, minVal, maxVal);
+                           n, scale, offset, minVal, maxVal, round);
+    }
+}
+
+//
+// Band shuffling
+//
+
+// One row of BandShuffle: band d of each dst pixel is band map[d] of the
+// src pixel, or fill (eBandFill), or left alone (eBandKeep).  NS and ND
+// are the band counts, or 0 if they are only known at run time.
+
+template <class T, int NS, int ND>
+static void ShuffleRow(const T* src, int nS, T* dst, int nD, const int map[], T fill, int n)
+{
+    const int ns = (NS) ? NS : nS;
+    const int nd = (ND) ? ND : nD;
+    for (int x = 0; x < n; x++, src += ns, dst += nd)
+        for (int d = 0; d < nd; d++)
+        {
+            int b = map[d];
+            if (b >= 0)
+                dst[d] = src[b];
+            else if (b == eBandFill)
+                dst[d] = fill;
+        }
+}
+
+// 4 bands -> the first 3 (BGRA -> BGR).  The scalar tail copies whole
+// pixels; the 4th value is overwritten by the next pixel
+
+template <class T>
+static void DropLastBandTail(const T* src, T* dst, int x, int n)
+{
+    for (; x < n-1; x++)
+        memcpy(&dst[3*x], &src[4*x], 4*sizeof(T));
+    for (; x < n; x++)
+        memcpy(&dst[3*x], &src[4*x], 3*sizeof(T));
+}
+
+static void DropLastBandRow(const uchar* src, int, uchar* dst, int, const int*, uchar, int n)
+{
+    int x = 0;
+#ifdef CONVERT_SSE2
+    __m128i color = _mm_set1_epi32(0x00ffffff);
+    __m128i even  = _mm_set_epi32(0, -1, 0, -1);    // pixels 0 and 2
+    __m128i lo64  = _mm_set_epi32(0, 0, -1, -1);
+    for (; x + 16 <= n; x += 16)
+    {
+        // compact each group of 4 pixels into bytes 0..11 of r[k]
+        __m128i r[4];
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i p = _mm_and_si128(_mm_loadu_si128((const __m128i *) &src[4*x + 16*k]), color);
+            // 2 pixels (6 bytes) in each 64-bit half, then close the gap
+            __m128i q = _mm_or_si128(_mm_and_si128(p, even),
+                                     _mm_srli_epi64(_mm_andnot_si128(even, p), 8));
+            r[k] = _mm_or_si128(_mm_and_si128(q, lo64),
+                                _mm_srli_si128(_mm_andnot_si128(lo64, q), 2));
+        }
+        // 4 x 12 bytes -> 3 x 16 bytes
+        _mm_storeu_si128((__m128i *) &dst[3*x],
+                         _mm_or_si128(r[0], _mm_slli_si128(r[1], 12)));
+        _mm_storeu_si128((__m128i *) &dst[3*x + 16],
+                         _mm_or_si128(_mm_srli_si128(r[1], 4), _mm_slli_si128(r[2], 8)));
+        _mm_storeu_si128((__m128i *) &dst[3*x + 32],
+                         _mm_or_si128(_mm_srli_si128(r[2], 8), _mm_slli_si128(r[3], 4)));
+    }
+#endif
+    DropLastBandTail(src, dst, x, n);
+}
+
+template <class T>
+static void DropLastBandRow(const T* src, int, T* dst, int, const int*, T, int n)
+{
+    // 32-bit values (int or float)
+    int x = 0;
+#ifdef CONVERT_SSE2
+    for (; x + 4 <= n; x += 4)
+    {
+        // 4 pixels in 4 registers -> 12 values in 3
+        const float* s = (const float *) &src[4*x];
+        __m128 v0 = _mm_loadu_ps(s),     v1 = _mm_loadu_ps(s + 4);
+        __m128 v2 = _mm_loadu_ps(s + 8), v3 = _mm_loadu_ps(s + 12);
+        __m128 a = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 2, 2));
+        __m128 b = _mm_shuffle_ps(v2, v3, _MM_SHUFFLE(0, 0, 2, 2));
+        float* d = (float *) &dst[3*x];
+        _mm_storeu_ps(d,     _mm_shuffle_ps(v0, a, _MM_SHUFFLE(2, 0, 1, 0)));
+        _mm_storeu_ps(d + 4, _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 0, 2, 1)));
+        _mm_storeu_ps(d + 8, _mm_shuffle_ps(b, v3, _MM_SHUFFLE(2, 1, 2, 0)));
+    }
+#endif
+    DropLastBandTail(src, dst, x, n);
+}
+
+// 1 band -> 4 (gray -> BGRA): every map entry is 0 or eBandFill
+
+static void BroadcastRow(const uchar* src, int, uchar* dst, int, const int map[], uchar fill, int n)
+{
+    int x = 0;
+#ifdef CONVERT_SSE2
+    uchar keepB[16], fillB[16];
+    for (int i = 0; i < 16; i++)
+    {
+        keepB[i] = (map[i%4] == 0) ? 0xff : 0;
+        fillB[i] = (map[i%4] == 0) ? 0 : fill;
+    }
+    __m128i keep  = _mm_loadu_si128((const __m128i *) keepB);
+    __m128i fillv = _mm_loadu_si128((const __m128i *) fillB);
+    for (; x + 16 <= n; x += 16)
+    {
+        // each gray value 4 times, then the fill values
+        __m128i g  = _mm_loadu_si128((const __m128i *) &src[x]);
+        __m128i lo = _mm_unpacklo_epi8(g, g);
+        __m128i hi = _mm_unpackhi_epi8(g, g);
+        __m128i q[4] = { _mm_unpacklo_epi16(lo, lo), _mm_unpackhi_epi16(lo, lo),
+                         _mm_unpacklo_epi16(hi, hi), _mm_unpackhi_epi16(hi, hi) };
+        for (int k = 0; k < 4; k++)
+            _mm_storeu_si128((__m128i *) &dst[4*x + 16*k],
+                             _mm_or_si128(_mm_and_si128(q[k], keep), fillv));
+    }
+#endif
+    for (; x < n; x++)
+        for (int d = 0; d < 4; d++)
+            dst[4*x + d] = (map[d] == 0) ? src[x] : fill;
+}
+
+template <class T>
+static void BroadcastRow(const T* src, int, T* dst, int, const int map[], T fill, int n)
+{
+    // 32-bit values (int or float)
+    int x = 0;
+#ifdef CONVERT_SSE2
+    int keepI[4], fillI[4];
+    for (int d = 0; d < 4; d++)
+    {
+        keepI[d] = (map[d] == 0) ? -1 : 0;
+        fillI[d] = 0;
+        if (map[d] != 0)
+            memcpy(&fillI[d], &fill, 4);
+    }
+    __m128 keep  = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) keepI));
+    __m128 fillv = _mm_castsi128_ps(_mm_loadu_si128((const __m128i *) fillI));
+    for (; x + 4 <= n; x += 4)
+    {
+        __m128 g = _mm_loadu_ps((const float *) &src[x]);
+        __m128 q[4] = { _mm_shuffle_ps(g, g, 0x00), _mm_shuffle_ps(g, g, 0x55),
+                        _mm_shuffle_ps(g, g, 0xaa), _mm_shuffle_ps(g, g, 0xff) };
+        for (int k = 0; k < 4; k++)
+            _mm_storeu_ps((float *) &dst[4*x + 4*k],
+                          _mm_or_ps(_mm_and_ps(q[k], keep), fillv));
+    }
+#endif
+    for (; x < n; x++)
+        for (int d = 0; d < 4; d++)
+            dst[4*x + d] = (map[d] == 0) ? src[x] : fill;
+}
+
+template <class T>
+struct CShuffleRow
+{
+    typedef void (*Fn)(const T* src, int nS, T* dst, int nD, const int map[], T fill, int n);
+};
+
+template <class T, int NS>
+static typename CShuffleRow<T>::Fn ShuffleRowFor(int nD)
+{
+    switch (nD)
+    {
+    case 1:  return ShuffleRow<T, NS, 1>;
+    case 2:  return ShuffleRow<T, NS, 2>;
+    case 3:  return ShuffleRow<T, NS, 3>;
+    case 4:  return ShuffleRow<T, NS, 4>;
+    default: return ShuffleRow<T, NS, 0>;
+    }
+}
+
+template <class T>
+static typename CShuffleRow<T>::Fn ShuffleRowFor(int nS, int nD, const int map[])
+{
+    // the vector code for BGRA -> BGR and gray -> BGRA
+    bool first3 = (nS == 4 && nD == 3), broadcast = (nS == 1 && nD == 4);
+    for (int d = 0; d < nD; d++)
+    {
+        first3 = first3 && map[d] == d;
+        broadcast = broadcast && (map[d] == 0 || map[d] == eBandFill);
+    }
+    if (first3)
+        return DropLastBandRow;
+    if (broadcast)
+        return BroadcastRow;
+
+    switch (nS)
+    {
+    case 1:  return ShuffleRowFor<T, 1>(nD);
+    case 2:  return ShuffleRowFor<T, 2>(nD);
+    case 3:  return ShuffleRowFor<T, 3>(nD);
+    case 4:  return ShuffleRowFor<T, 4>(nD);
+    default: return ShuffleRowFor<T, 0>(nD);
+    }
+}
+
+static bool SamePixels(const CImage& a, const CImage& b)
+{
+    // Do a and b use the same pixel memory?
+    CShape sa = a.Shape(), sb = b.Shape();
+    return sa.width > 0 && sa.height > 0 && sa.nBands > 0 &&
+           sb.width > 0 && sb.height > 0 && sb.nBands > 0 &&
+           a.PixelAddress(0, 0, 0) == b.PixelAddress(0, 0, 0);
+}
+
+template <class T>
+extern void BandShuffle(const CImageOf<T>& src, CImageOf<T>& dst,
+                        const int bandMap[], int nDstBands, T fill)
+{
+    // Check the map
+    CShape sShape = src.Shape();
+    for (int d = 0; d < nDstBands; d++)
+        if (bandMap[d] >= sShape.nBands || bandMap[d] < eBandKeep)
+            throw CError("BandShuffle: source band %d is invalid", bandMap[d]);
+
+    // Work from a copy of the source if it uses the pixels of dst
+    CImageOf<T> copy;
+    const CImageOf<T>& s = (&src == &dst || SamePixels(src, dst)) ?
+        (CopyPixels(src, copy), copy) : src;
+
+    // Make sure the shapes (ignoring bands) are compatible
+    CShape dShape(sShape.width, sShape.height, nDstBands);
+    if (dst.Shape() != dShape)
+        dst.ReAllocate(dShape);
+
+    // Process each row
+    typename CShuffleRow<T>::Fn row = ShuffleRowFor<T>(sShape.nBands, nDstBands, bandMap);
+    for (int y = 0; y < sShape.height; y++)
+        row(&s.Pixel(0, y, 0), sShape.nBands, &dst.Pixel(0, y, 0), nDstBands,
+            bandMap, fill, sShape.width);
+}
+
+// One row of SplitBands and MergeBands (NB = number of bands, or 0)
+
+template <class T, int NB>
+static void SplitRow(const T* src, int nB, T* const planes[], int n)
+{
+    const int nb = (NB) ? NB : nB;
+    for (int x = 0; x < n; x++, src += nb)
+        for (int b = 0; b < nb; b++)
+            planes[b][x] = src[b];
+}
+
+template <class T, int NB>
+static void MergeRow(const T* const planes[], int nB, T* dst, int n)
+{
+    const int nb = (NB) ? NB : nB;
+    for (int x = 0; x < n; x++, dst += nb)
+        for (int b = 0; b < nb; b++)
+            dst[b] = planes[b][x];
+}
+
+// 2 bands (e.g., flow u, v)
+
+static void SplitRow2(const uchar* src, uchar* p0, uchar* p1, int n)
+{
+    int x = 0;
+#ifdef CONVERT_SSE2
+    __m128i even = _mm_set1_epi16(0xff);
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *) &src[2*x]);
+        __m128i b = _mm_loadu_si128((const __m128i *) &src[2*x + 16]);
+        _mm_storeu_si128((__m128i *) &p0[x],
+                         _mm_packus_epi16(_mm_and_si128(a, even), _mm_and_si128(b, even)));
+        _mm_storeu_si128((__m128i *) &p1[x],
+                         _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+#endif
+    for (; x < n; x++)
+    {
+        p0[x] = src[2*x];
+        p1[x] = src[2*x + 1];
+    }
+}
+
+template <class T>
+static void SplitRow2(const T* src, T* p0, T* p1, int n)
+{
+    // 32-bit values (int or float)
+    int x = 0;
+#ifdef CONVERT_SSE2
+    for (; x + 4 <= n; x += 4)
+    {
+        __m128 a = _mm_loadu_ps((const float *) &src[2*x]);
+        __m128 b = _mm_loadu_ps((const float *) &src[2*x + 4]);
+        _mm_storeu_ps((float *) &p0[x], _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps((float *) &p1[x], _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#endif
+    for (; x < n; x++)
+    {
+        p0[x] = src[2*x];
+        p1[x] = src[2*x + 1];
+    }
+}
+
+static void MergeRow2(const uchar* p0, const uchar* p1, uchar* dst, int n)
+{
+    int x = 0;
+#ifdef CONVERT_SSE2
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *) &p0[x]);
+        __m128i b = _mm_loadu_si128((const __m128i *) &p1[x]);
+        _mm_storeu_si128((__m128i *) &dst[2*x],      _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *) &dst[2*x + 16], _mm_unpackhi_epi8(a, b));
+    }
+#endif
+    for (; x < n; x++)
+    {
+        dst[2*x]     = p0[x];
+        dst[2*x + 1] = p1[x];
+    }
+}
+
+template <class T>
+static void MergeRow2(const T* p0, const T* p1, T* dst, int n)
+{
+    // 32-bit values (int or float)
+    int x = 0;
+#ifdef CONVERT_SSE2
+    for (; x + 4 <= n; x += 4)
+    {
+        __m128 a = _mm_loadu_ps((const float *) &p0[x]);
+        __m128 b = _mm_loadu_ps((const float *) &p1[x]);
+        _mm_storeu_ps((float *) &dst[2*x],     _mm_unpacklo_ps(a, b));
+        _mm_storeu_ps((float *) &dst[2*x + 4], _mm_unpackhi_ps(a, b));
+    }
+#endif
+    for (; x < n; x++)
+    {
+        dst[2*x]     = p0[x];
+        dst[2*x + 1] = p1[x];
+    }
+}
+
+template <class T>
+extern void SplitBands(const CImageOf<T>& src, CImageOf<T> planes[])
+{
+    // Make each plane a 1-band image of the size of src
+    CShape sShape = src.Shape();
+    int nB = sShape.nBands;
+    CShape pShape(sShape.width, sShape.height, 1);
+    for (int b = 0; b < nB; b++)
+        if (planes[b].Shape() != pShape)
+            planes[b].ReAllocate(pShape);
+
+    // Process each row, writing all the planes in one pass
+    std::vector<T*> pRows(nB);
+    for (int y = 0; y < sShape.height; y++)
+    {
+        const T* srcP = &src.Pixel(0, y, 0);
+        for (int b = 0; b < nB; b++)
+            pRows[b] = &planes[b].Pixel(0, y, 0);
+        switch (nB)
+        {
+        case 1:  SplitRow<T, 1>(srcP, nB, &pRows[0], sShape.width); break;
+        case 2:  SplitRow2(srcP, pRows[0], pRows[1], sShape.width); break;
+        case 3:  SplitRow<T, 3>(srcP, nB, &pRows[0], sShape.width); break;
+        case 4:  SplitRow<T, 4>(srcP, nB, &pRows[0], sShape.width); break;
+        default: SplitRow<T, 0>(srcP, nB, &pRows[0], sShape.width); break;
+        }
+    }
+}
+
+template <class T>
+extern void MergeBands(const CImageOf<T> planes[], int nPlanes, CImageOf<T>& dst)
+{
+    // Make sure the planes are 1-band images of the same size
+    if (nPlanes < 1)
+        throw CError("MergeBands: need at least one plane");
+    CShape pShape = planes[0].Shape();
+    for (int b = 0; b < nPlanes; b++)
+        if (planes[b].Shape() != CShape(pShape.width, pShape.height, 1))
+            throw CError("MergeBands: plane %d is not a 1-band image of the size of plane 0", b);
+    CShape dShape(pShape.width, pShape.height, nPlanes);
+    if (dst.Shape() != dShape)
+        dst.ReAllocate(dShape);
+
+    // Process each row, reading all the planes in one pass
+    std::vector<const T*> pRows(nPlanes);
+    for (int y = 0; y < dShape.height; y++)
+    {
+        T* dstP = &dst.Pixel(0, y, 0);
+        for (int b = 0; b < nPlanes; b++)
+            pRows[b] = &planes[b].Pixel(0, y, 0);
+        switch (nPlanes)
+        {
+        case 1:  MergeRow<T, 1>(&pRows[0], nPlanes, dstP, dShape.width); break;
+        case 2:  MergeRow2(pRows[0], pRows[1], dstP, dShape.width); break;
+        case 3:  MergeRow<T, 3>(&pRows[0], nPlanes, dstP, dShape.width); break;
+        case 4:  MergeRow<T, 4>(&pRows[0], nPlanes, dstP, dShape.width); break;
+        default: MergeRow<T, 0>(&pRows[0], nPlanes, dstP, dShape.width); break;
+        }
     }
 }
 
 template <class T>
-extern CImageOf<T> ConvertToRGBA(CImageOf<T> src)
+extern CImageOf<T> ConvertToRGBA(const CImageOf<T>& src)
 {
     // Check if already RGBA
     CShape sShape = src.Shape();
@@ -101,21 +700,16 @@ extern CImageOf<T> ConvertToRGBA(CImageOf<T> src)
     CShape dShape(sShape.width, sShape.height, 4);
     CImageOf<T> dst(dShape);
 
-    // Process each row
-    int aC = dst.alphaChannel;
-    for (int y = 0; y < sShape.height; y++)
-    {
-        T* srcP = &src.Pixel(0, y, 0);
-        T* dstP = &dst.Pixel(0, y, 0);
-        for (int x = 0; x < sShape.width; x++, srcP++)
-            for (int b = 0; b < dShape.nBands; b++, dstP++)
-                *dstP = (b == aC) ? 255 : *srcP;
-    }
+    // Replicate the gray band, with alpha == 255
+    int map[4] = {0, 0, 0, 0};
+    if (0 <= dst.alphaChannel && dst.alphaChannel < 4)
+        map[dst.alphaChannel] = eBandFill;
+    BandShuffle(src, dst, map, 4, (T) 255);
     return dst;
 }
 
 template <class T>
-extern CImageOf<T> ConvertToGray(CImageOf<T> src)
+extern CImageOf<T> ConvertToGray(const CImageOf<T>& src)
 {
     // Check if already gray
     CShape sShape = src.Shape();
@@ -135,11 +729,11 @@ extern CImageOf<T> ConvertToGray(CImageOf<T> src)
     T maxVal = dst.MaxVal();
     for (int y = 0; y < sShape.height; y++)
     {
-        T* srcP = &src.Pixel(0, y, 0);
+        const T* srcP = &src.Pixel(0, y, 0);
         T* dstP = &dst.Pixel(0, y, 0);
         for (int x = 0; x < sShape.width; x++, srcP += 4, dstP++)
         {
-            RGBA<T>& p = *(RGBA<T> *) srcP;
+            const RGBA<T>& p = *(const RGBA<T> *) srcP;
             // OLD FORMULA: float Y = (float)(0.212671 * p.R + 0.715160 * p.G + 0.072169 * p.B);
 	    // Changed to commonly used formula 6/4/07 DS
             float Y = (float)(0.299 * p.R + 0.587 * p.G + 0.114 * p.B);
@@ -150,7 +744,7 @@ extern CImageOf<T> ConvertToGray(CImageOf<T> src)
 }
 
 template <class T>
-extern void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand)
+extern void BandSelect(const CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand)
 {
     // Convert between images of same type but different # of bands
     CShape sShape = src.Shape();
@@ -173,14 +767,10 @@ extern void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand)
     if (dBand < 0 || dBand >= dB)
         throw CError("BandSelect: destination band %d is invalid", dBand);
 
-    // Process each row
-    for (int y = 0; y < sShape.height; y++)
-    {
-        T* srcP = &src.Pixel(0, y, 0);
-        T* dstP = &dst.Pixel(0, y, 0);
-        for (int x = 0; x < sShape.width; x++, srcP += sB, dstP += dB)
-            dstP[dBand] = srcP[sBand];
-    }
+    // Copy the band, keeping the other bands of dst
+    std::vector<int> map(dB, (int) eBandKeep);
+    map[dBand] = sBand;
+    BandShuffle(src, dst, &map[0], dB);
 }
 
 //
@@ -201,32 +791,52 @@ void CopyPixelsInstantiate(CImageOf<T1>& s1)
 }
 */
 // ... so do it like this instead:
-template void ScaleAndOffset(CByteImage&  src, CByteImage&  dst, float s, float o);
-template void ScaleAndOffset(CByteImage&  src, CIntImage&   dst, float s, float o);
-template void ScaleAndOffset(CByteImage&  src, CFloatImage& dst, float s, float o);
-template void ScaleAndOffset(CIntImage&   src, CByteImage&  dst, float s, float o);
-template void ScaleAndOffset(CIntImage&   src, CIntImage&   dst, float s, float o);
-template void ScaleAndOffset(CIntImage&   src, CFloatImage& dst, float s, float o);
-template void ScaleAndOffset(CFloatImage& src, CByteImage&  dst, float s, float o);
-template void ScaleAndOffset(CFloatImage& src, CIntImage&   dst, float s, float o);
-template void ScaleAndOffset(CFloatImage& src, CFloatImage& dst, float s, float o);
-
-// also need (for Convolve) at least this:
-template void ScaleAndOffsetLine(float* src, float* dst, int n, float scale, float offset, float minVal, float maxVal);
+template void ScaleAndOffset(const CByteImage&  src, CByteImage&  dst, float s, float o, bool r);
+template void ScaleAndOffset(const CByteImage&  src, CIntImage&   dst, float s, float o, bool r);
+template void ScaleAndOffset(const CByteImage&  src, CFloatImage& dst, float s, float o, bool r);
+template void ScaleAndOffset(const CIntImage&   src, CByteImage&  dst, float s, float o, bool r);
+template void ScaleAndOffset(const CIntImage&   src, CIntImage&   dst, float s, float o, bool r);
+template void ScaleAndOffset(const CIntImage&   src, CFloatImage& dst, float s, float o, bool r);
+template void ScaleAndOffset(const CFloatImage& src, CByteImage&  dst, float s, float o, bool r);
+template void ScaleAndOffset(const CFloatImage& src, CIntImage&   dst, float s, float o, bool r);
+template void ScaleAndOffset(const CFloatImage& src, CFloatImage& dst, float s, float o, bool r);
+
+// also need (for Convolve and other callers) these:
+template void ScaleAndOffsetLine(const uchar* src, uchar* dst, int n, float scale, float offset, uchar minVal, uchar maxVal, bool round);
+template void ScaleAndOffsetLine(const uchar* src, int* dst, int n, float scale, float offset, int minVal, int maxVal, bool round);
+template void ScaleAndOffsetLine(const uchar* src, float* dst, int n, float scale, float offset, float minVal, float maxVal, bool round);
+template void ScaleAndOffsetLine(const int* src, uchar* dst, int n, float scale, float offset, uchar minVal, uchar maxVal, bool round);
+template void ScaleAndOffsetLine(const int* src, int* dst, int n, float scale, float offset, int minVal, int maxVal, bool round);
+template void ScaleAndOffsetLine(const int* src, float* dst, int n, float scale, float offset, float minVal, float maxVal, bool round);
+template void ScaleAndOffsetLine(const float* src, uchar* dst, int n, float scale, float offset, uchar minVal, uchar maxVal, bool round);
+template void ScaleAndOffsetLine(const float* src, int* dst, int n, float scale, float offset, int minVal, int maxVal, bool round);
+template void ScaleAndOffsetLine(const float* src, float* dst, int n, float scale, float offset, float minVal, float maxVal, bool round);
 
 // same here:
 
-template CByteImage ConvertToGray(CByteImage src);
-template CIntImage ConvertToGray(CIntImage src);
-template CFloatImage ConvertToGray(CFloatImage src);
+template CByteImage ConvertToGray(const CByteImage& src);
+template CIntImage ConvertToGray(const CIntImage& src);
+template CFloatImage ConvertToGray(const CFloatImage& src);
+
+template CByteImage ConvertToRGBA(const CByteImage& src);
+template CIntImage ConvertToRGBA(const CIntImage& src);
+template CFloatImage ConvertToRGBA(const CFloatImage& src);
+
+template void BandSelect(const CByteImage&  src, CByteImage&  dst, int sBand, int dBand);
+template void BandSelect(const CIntImage&   src, CIntImage&   dst, int sBand, int dBand);
+template void BandSelect(const CFloatImage& src, CFloatImage& dst, int sBand, int dBand);
+
+template void BandShuffle(const CByteImage&  src, CByteImage&  dst, const int bandMap[], int nDstBands, uchar fill);
+template void BandShuffle(const CIntImage&   src, CIntImage&   dst, const int bandMap[], int nDstBands, int fill);
+template void BandShuffle(const CFloatImage& src, CFloatImage& dst, const int bandMap[], int nDstBands, float fill);
 
-template CByteImage ConvertToRGBA(CByteImage src);
-template CIntImage ConvertToRGBA(CIntImage src);
-template CFloatImage ConvertToRGBA(CFloatImage src);
+template void SplitBands(const CByteImage&  src, CByteImage  planes[]);
+template void SplitBands(const CIntImage&   src, CIntImage   planes[]);
+template void SplitBands(const CFloatImage& src, CFloatImage planes[]);
 
-template void BandSelect(CByteImage&  src, CByteImage&  dst, int sBand, int dBand);
-template void BandSelect(CIntImage&   src, CIntImage&   dst, int sBand, int dBand);
-template void BandSelect(CFloatImage& src, CFloatImage& dst, int sBand, int dBand);
+template void MergeBands(const CByteImage  planes[], int nPlanes, CByteImage&  dst);
+template void MergeBands(const CIntImage   planes[], int nPlanes, CIntImage&   dst);
+template void MergeBands(const CFloatImage planes[], int nPlanes, CFloatImage& dst);
 
 /*
 template <class T>
@@ -6,33 +6,64 @@
 // DESCRIPTION
 //  This file defines a number of conversion/copying utilities:
 //
-//  void ScaleAndOffset(CImageOf<T1>& src, CImageOf<T2>& dst,
-//                       float scale, float offset);
+//  void ScaleAndOffset(const CImageOf<T1>& src, CImageOf<T2>& dst,
+//                      float scale, float offset, bool round = false);
 //      -- scale and offset one image into another (optionally convert type)
 //
-//  void CopyPixels(CImageOf<T1>& src, CImageOf<T2>& dst);
+//  void ScaleAndOffsetLine(const T1* src, T2* dst, int n,
+//                          float scale, float offset,
+//                          T2 minVal, T2 maxVal, bool round = false);
+//      -- the same for n values, clipped to [minVal, maxVal] unless
+//          minVal >= maxVal
+//
+//  void CopyPixels(const CImageOf<T1>& src, CImageOf<T2>& dst);
 //      -- convert pixel types or just copy pixels from src to dst
 //
-//  CImageOf<T> ConvertToRGBA(CImageOf<T> src);
+//  CImageOf<T> ConvertToRGBA(const CImageOf<T>& src);
 //      -- convert from gray (1-band) image to RGBA (alpha == 255)
 //
-//  CImageOf<T> ConvertToGray(CImageOf<T> src);
+//  CImageOf<T> ConvertToGray(const CImageOf<T>& src);
 //      -- convert from RGBA (4-band) image to gray, using Y formula,
 //          Y = 0.212671 * R + 0.715160 * G + 0.072169 * B
 //
-//  void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand);
+//  void BandSelect(const CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand);
 //      -- copy the sBand from src into the dBand in dst
 //
+//  void BandShuffle(const CImageOf<T>& src, CImageOf<T>& dst,
+//                   const int bandMap[], int nDstBands, T fill = 0);
+//      -- make dst an nDstBands image whose band d is band bandMap[d] of
+//          src, or fill (bandMap[d] == eBandFill), or left as it is
+//          (bandMap[d] == eBandKeep), e.g., {0, 1, 2} for BGRA -> BGR,
+//          {0, 0, 0, eBandFill} and fill = 255 for gray -> BGRA
+//
+//  void SplitBands(const CImageOf<T>& src, CImageOf<T> planes[]);
+//      -- deinterleave: planes[b] becomes a 1-band image with band b of src
+//          (planes must have room for src.Shape().nBands images)
+//
+//  void MergeBands(const CImageOf<T> planes[], int nPlanes, CImageOf<T>& dst);
+//      -- interleave nPlanes 1-band images of the same size into dst
+//
+//  Conversions to uchar and int clip (saturate) to the range of the
+//  destination type and truncate the fractional part, unless round is
+//  set: then they round to the nearest integer (ties to even).  The line
+//  routine uses SSE2 where available, with the same results.
+//
 //  The ScaleAndOffset and CopyPixels routines will reallocate dst if it
 //  doesn't conform in shape to src.  So will BandSelect, except that the
 //  number of bands in src and dst is allowed to differ (if dst is
 //  unitialized, it will be set to a 1-band image).
 //
+//  The band routines make a single pass over the pixels.  Vector shuffles
+//  (SSE2) are used only for 2-band split/merge (e.g., flow u, v), BGRA ->
+//  BGR and gray -> BGRA; the other mappings use scalar loops, unrolled
+//  for 1 to 4 bands.  BandSelect and ConvertToRGBA use BandShuffle.
+//
 // PARAMETERS
 //  src                 source image
 //  dst                 destination image
 //  scale               floating point scale value  (1.0 = no change)
 //  offset              floating point offset value (0.0 = no change)
+//  round               round to nearest when converting to uchar or int
 //  sBand               source band (0...)
 //  dBand               destination band (0...)
 //
@@ -46,25 +77,42 @@
 ///////////////////////////////////////////////////////////////////////////
 
 template <class T1, class T2>
-void ScaleAndOffsetLine(T1* src, T2* dst, int n,
+void ScaleAndOffsetLine(const T1* src, T2* dst, int n,
                         float scale, float offset,
-                        T2 minVal, T2 maxVal);
+                        T2 minVal, T2 maxVal, bool round = false);
 
 template <class T1, class T2>
-void ScaleAndOffset(CImageOf<T1>& src, CImageOf<T2>& dst,
-                    float scale, float offset);
+void ScaleAndOffset(const CImageOf<T1>& src, CImageOf<T2>& dst,
+                    float scale, float offset, bool round = false);
 
 template <class T1, class T2>
-inline void CopyPixels(CImageOf<T1>& src, CImageOf<T2>& dst)
+inline void CopyPixels(const CImageOf<T1>& src, CImageOf<T2>& dst)
 {
     ScaleAndOffset(src, dst, 1.0f, 0.0f);
 }
 
 template <class T>
-CImageOf<T> ConvertToRGBA(CImageOf<T> src);
+CImageOf<T> ConvertToRGBA(const CImageOf<T>& src);
+
+template <class T>
+CImageOf<T> ConvertToGray(const CImageOf<T>& src);
+
+template <class T>
+void BandSelect(const CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand);
+
+// special bandMap entries for BandShuffle
+enum EBandSource
+{
+    eBandFill = -1,         // set the band to the fill value
+    eBandKeep = -2          // leave the band of dst as it is
+};
+
+template <class T>
+void BandShuffle(const CImageOf<T>& src, CImageOf<T>& dst,
+                 const int bandMap[], int nDstBands, T fill = 0);
 
 template <class T>
-CImageOf<T> ConvertToGray(CImageOf<T> src);
+void SplitBands(const CImageOf<T>& src, CImageOf<T> planes[]);
 
 template <class T>
-void BandSelect(CImageOf<T>& src, CImageOf<T>& dst, int sBand, int dBand);
+void MergeBands(const CImageOf<T> planes[], int nPlanes, CImageOf<T>& dst);
@@ -10,12 +10,37 @@
 //  with minimal loss in precision.  This also avoids excessive type
 //  conversion during convolution, since the kernels are floats anyway.
 //
-//  If fixpoint variants are desired for efficiency (e.g., using
-//  multimedia extensions), then this would have to be modified.
+//  The separable code recognizes the default kernels (ConvolveKernel_121
+//  etc.) by their taps, and then uses loops with the taps as compile-time
+//  constants.  For byte images and the 1-2-1, 1-3-3-1 and 1-4-6-4-1
+//  kernels it works on 16-bit integer rows instead, with a shift for the
+//  division; the float sums of these kernels are exact, so both give
+//  the same results.
 //
-//  TODO:  this current version is not very efficient.  For example,
-//  the separable code uses an intermediate image, instead of just a
-//  row buffer.  Also, downsampling convolution could be more efficient.
+//  The inner loops run over the interleaved floats of a buffer row, so
+//  all the bands of a pixel are handled by the same (SSE2) code; the
+//  loops are instantiated for 1 to 4 bands, so that the band stride is
+//  a constant.  They accumulate the terms in the same order as a plain
+//  scalar loop over the kernel rows and columns, so the results do not
+//  depend on whether SSE2 is available.
+//
+//  The row buffer of Convolve is a window of row pointers that is
+//  rotated after each output row, so only the new row is filled.  Only
+//  the border pixels of a row go through the border mode, using a table
+//  of source columns that is computed once per image.
+//
+//  The separable code streams: it keeps a ring of horizontally filtered
+//  rows (as many as the vertical kernel is tall), and only computes the
+//  rows and columns that survive decimation.  The horizontal results
+//  are rounded to the pixel type before the vertical pass, and the
+//  vertical pass replicates the border rows, as in the original version
+//  that convolved into two intermediate images.
+//
+//  Both routines can split the output rows into bands, one per thread.
+//  Each band primes its own row window (or ring) with the rows above
+//  its first output row, so a band computes exactly the same rows as
+//  the serial code; only in-place calls need a temporary result, since
+//  a band must not overwrite the source rows that its neighbours read.
 //
 // SEE ALSO
 //  Convolve.h          longer description of these routines
@@ -29,10 +54,19 @@
 #include "Error.h"
 #include "Convert.h"
 #include "Convolve.h"
+#include "Parallel.h"
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CONVOLVE_SSE2
+#include <emmintrin.h>
+#endif
 
 static int TrimIndex(int k, EBorderMode e, int n)
 {
     // Compute the index value 0 <= k < n (return -1 for Zero mode)
+    if (0 <= k && k < n)
+        return k;
     switch (e)
     {
     case eBorderReplicate:  // replicate border values
@@ -51,151 +85,538 @@ static int TrimIndex(int k, EBorderMode e, int n)
     throw CError("Convolve[Separable]: %d is not a valid borderMode", int(e));
 }
 
+static void ConvertLine(const float src[], float dst[], int n)
+{
+    memcpy(dst, src, n * sizeof(float));
+}
+
+static void ConvertLine(const uchar src[], float dst[], int n)
+{
+    int i = 0;
+#ifdef CONVOLVE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i b  = _mm_loadu_si128((const __m128i *) &src[i]);
+        __m128i lo = _mm_unpacklo_epi8(b, zero);
+        __m128i hi = _mm_unpackhi_epi8(b, zero);
+        _mm_storeu_ps(&dst[i],    _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_ps(&dst[i+4],  _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_ps(&dst[i+8],  _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_ps(&dst[i+12], _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = (float) src[i];
+}
+
 template <class T>
-static void FillRowBuffer(float buf[], CImageOf<T>& src, CFloatImage& kernel,
-                          int k, int n)
+static void ConvertLine(const T src[], float dst[], int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = (float) src[i];
+}
+
+static void ConvertLine(const uchar src[], short dst[], int n)
+{
+    int i = 0;
+#ifdef CONVOLVE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i *) &src[i]);
+        _mm_storeu_si128((__m128i *) &dst[i],   _mm_unpacklo_epi8(b, zero));
+        _mm_storeu_si128((__m128i *) &dst[i+8], _mm_unpackhi_epi8(b, zero));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = src[i];
+}
+
+static void ConvertLine(const short src[], uchar dst[], int n)
+{
+    // values must be in 0 .. 255
+    int i = 0;
+#ifdef CONVOLVE_SSE2
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *) &src[i]);
+        __m128i hi = _mm_loadu_si128((const __m128i *) &src[i+8]);
+        _mm_storeu_si128((__m128i *) &dst[i], _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = (uchar) src[i];
+}
+
+// Array of n elements, on the stack unless n is large (kernel taps etc.)
+
+#define SMALL_ARRAY_SIZE 32
+
+template <class T>
+class CSmallArray
+{
+public:
+    CSmallArray(int n) : m_heap(n > SMALL_ARRAY_SIZE ? n : 0)
+    {
+        m_ptr = (n > SMALL_ARRAY_SIZE) ? &m_heap[0] : m_local;
+    }
+    T& operator[](int i)                { return m_ptr[i]; }
+    const T& operator[](int i) const    { return m_ptr[i]; }
+    T* Data()                           { return m_ptr; }
+
+private:
+    CSmallArray(const CSmallArray&);    // not copyable (m_ptr)
+    T m_local[SMALL_ARRAY_SIZE];
+    std::vector<T> m_heap;
+    T* m_ptr;
+};
+
+// Fills row buffers of m pixels (floats, or shorts for byte images):
+// buffer pixel l of row k is the source pixel (l + origin[0],
+// k + origin[1]), with the border mode applied.
+// The pixels [l1, l2) lie inside the source row and are copied or
+// converted in one run; the source columns of the others are looked up
+// in a table that is built once per image (-1 for zero padding).
+
+template <class T>
+class CRowFiller
+{
+public:
+    CRowFiller(const CImageOf<T>& src, const CFloatImage& kernel, int m);
+    template <class B>
+    void Fill(B buf[], int k) const;
+
+private:
+    static int Begin(const CFloatImage& kernel, int m)
+    {
+        return __max(0, __min(m, -kernel.origin[0]));
+    }
+    static int End(const CImage& src, const CFloatImage& kernel, int m)
+    {
+        return __max(Begin(kernel, m), __min(m, src.Shape().width - kernel.origin[0]));
+    }
+
+    const CImageOf<T>& m_src;
+    int m_m, m_l1, m_l2;        // buffer width, interior pixels [l1, l2)
+    int m_originX, m_originY;   // kernel origin
+    CSmallArray<int> m_border;  // source columns of [0, l1), then of [l2, m)
+};
+
+template <class T>
+CRowFiller<T>::CRowFiller(const CImageOf<T>& src, const CFloatImage& kernel, int m) :
+    m_src(src), m_m(m), m_l1(Begin(kernel, m)), m_l2(End(src, kernel, m)),
+    m_originX(kernel.origin[0]), m_originY(kernel.origin[1]),
+    m_border(m - (m_l2 - m_l1))
+{
+    int width = src.Shape().width;
+    int i = 0;
+    for (int l = 0; l < m_l1; l++)
+        m_border[i++] = TrimIndex(l + m_originX, src.borderMode, width);
+    for (int l = m_l2; l < m; l++)
+        m_border[i++] = TrimIndex(l + m_originX, src.borderMode, width);
+}
+
+template <class T, class B>
+static inline void FillBorderPixel(B buf[], const T* srcP, int l0, int nB)
+{
+    if (l0 < 0)
+        memset(buf, 0, nB * sizeof(B));
+    else
+        for (int b = 0; b < nB; b++)
+            buf[b] = (B)srcP[l0*nB + b];
+}
+
+template <class T>
+template <class B>
+void CRowFiller<T>::Fill(B buf[], int k) const
 {
     // Compute the real row address
-    CShape sShape = src.Shape();
+    CShape sShape = m_src.Shape();
     int nB = sShape.nBands;
-    int k0 = TrimIndex(k + kernel.origin[1], src.borderMode, sShape.height);
+    int k0 = TrimIndex(k + m_originY, m_src.borderMode, sShape.height);
     if (k0 < 0)
     {
-        memset(buf, 0, n * sizeof(float));
+        memset(buf, 0, m_m * nB * sizeof(B));
         return;
     }
 
-    // Fill the row
-    T* srcP = &src.Pixel(0, k0, 0);
-    int m = n / nB;
-    for (int l = 0; l < m; l++, buf += nB)
+    // Fill the row: interior in one run, borders from the table
+    const T* srcP = &m_src.Pixel(0, k0, 0);
+    ConvertLine(&srcP[(m_l1 + m_originX)*nB], &buf[m_l1*nB], (m_l2 - m_l1)*nB);
+    int i = 0;
+    for (int l = 0; l < m_l1; l++)
+        FillBorderPixel(&buf[l*nB], srcP, m_border[i++], nB);
+    for (int l = m_l2; l < m_m; l++)
+        FillBorderPixel(&buf[l*nB], srcP, m_border[i++], nB);
+}
+
+// dst[j] (+)= sum_l kRow[l] * src[j + l*nB] for the n floats of a row
+// (horizontal pass; NB = nB, or 0 if it is only known at run time)
+
+template <int NB>
+static void AccumulateRow(const float src[], const float kRow[], int kX,
+                          float dst[], int n, int nB, bool first)
+{
+    const int nb = (NB) ? NB : nB;
+    int j = 0;
+#ifdef CONVOLVE_SSE2
+    for (; j + 8 <= n; j += 8)
     {
-        int l0 = TrimIndex(l + kernel.origin[0], src.borderMode, sShape.width);
-        if (l0 < 0)
-            memset(buf, 0, nB * sizeof(T));
-        else
-            for (int b = 0; b < nB; b++)
-                buf[b] = (float)srcP[l0*nB + b];
+        __m128 s0 = (first) ? _mm_setzero_ps() : _mm_loadu_ps(&dst[j]);
+        __m128 s1 = (first) ? _mm_setzero_ps() : _mm_loadu_ps(&dst[j+4]);
+        const float* p = &src[j];
+        for (int l = 0; l < kX; l++, p += nb)
+        {
+            __m128 kv = _mm_set1_ps(kRow[l]);
+            s0 = _mm_add_ps(s0, _mm_mul_ps(kv, _mm_loadu_ps(p)));
+            s1 = _mm_add_ps(s1, _mm_mul_ps(kv, _mm_loadu_ps(p + 4)));
+        }
+        _mm_storeu_ps(&dst[j],   s0);
+        _mm_storeu_ps(&dst[j+4], s1);
+    }
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128 s0 = (first) ? _mm_setzero_ps() : _mm_loadu_ps(&dst[j]);
+        const float* p = &src[j];
+        for (int l = 0; l < kX; l++, p += nb)
+            s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_set1_ps(kRow[l]), _mm_loadu_ps(p)));
+        _mm_storeu_ps(&dst[j], s0);
+    }
+#endif
+    for (; j < n; j++)
+    {
+        float sum = (first) ? 0.0f : dst[j];
+        const float* p = &src[j];
+        for (int l = 0; l < kX; l++, p += nb)
+            sum += kRow[l] * p[0];
+        dst[j] = sum;
+    }
+}
+
+// dst[j] = sum_t k[t*kStride] * taps[t][j] for j = 0 .. n-1, summed in
+// the order of the taps, like AccumulateRow (vertical passes, and the
+// horizontal pass of the separable code, which has one tap array per phase)
+
+static void ConvolveTaps(const float* const taps[], const float k[], ptrdiff_t kStride,
+                         int nTaps, float dst[], int n)
+{
+    int j = 0;
+#ifdef CONVOLVE_SSE2
+    for (; j + 8 <= n; j += 8)
+    {
+        __m128 s0 = _mm_setzero_ps();
+        __m128 s1 = _mm_setzero_ps();
+        for (int t = 0; t < nTaps; t++)
+        {
+            __m128 kv = _mm_set1_ps(k[t*kStride]);
+            s0 = _mm_add_ps(s0, _mm_mul_ps(kv, _mm_loadu_ps(&taps[t][j])));
+            s1 = _mm_add_ps(s1, _mm_mul_ps(kv, _mm_loadu_ps(&taps[t][j+4])));
+        }
+        _mm_storeu_ps(&dst[j],   s0);
+        _mm_storeu_ps(&dst[j+4], s1);
+    }
+#endif
+    for (; j < n; j++)
+    {
+        float sum = 0.0f;
+        for (int t = 0; t < nTaps; t++)
+            sum += k[t*kStride] * taps[t][j];
+        dst[j] = sum;
+    }
+}
+
+// The default kernels (see KernelInit below) as compile-time constants:
+// tap t is W[t] / 2^SHIFT, which is exact in float
+
+struct CKernel121           { enum { N = 3, SHIFT = 2 }; static const int W[N]; };
+struct CKernel1331          { enum { N = 4, SHIFT = 3 }; static const int W[N]; };
+struct CKernel14641         { enum { N = 5, SHIFT = 4 }; static const int W[N]; };
+struct CKernel8TapLowPass   { enum { N = 8, SHIFT = 8 }; static const int W[N]; };
+
+const int CKernel121::W[]         = {1, 2, 1};
+const int CKernel1331::W[]        = {1, 3, 3, 1};
+const int CKernel14641::W[]       = {1, 4, 6, 4, 1};
+const int CKernel8TapLowPass::W[] = {-12, -15, 40, 115, 115, 40, -15, -12};
+
+template <class K>
+static inline float Tap(int t)
+{
+    return (float) K::W[t] / (1 << K::SHIFT);
+}
+
+template <class K>
+static bool IsKernel(const CFloatImage& kernel)
+{
+    // Does kernel (a 1-row kernel) have the taps of K?
+    CShape kShape = kernel.Shape();
+    if (kShape.width != K::N || kShape.height != 1 || kShape.nBands != 1)
+        return false;
+    for (int t = 0; t < K::N; t++)
+        if (kernel.Pixel(t, 0, 0) != Tap<K>(t))
+            return false;
+    return true;
+}
+
+// ConvolveTaps with the taps of K (k, kStride and nTaps are ignored):
+// the loop over the taps is unrolled, and the taps are not loaded
+
+template <class K>
+static void ConvolveTapsOf(const float* const taps[], const float* /*k*/, ptrdiff_t /*kStride*/,
+                           int /*nTaps*/, float dst[], int n)
+{
+    int j = 0;
+#ifdef CONVOLVE_SSE2
+    for (; j + 8 <= n; j += 8)
+    {
+        __m128 s0 = _mm_setzero_ps();
+        __m128 s1 = _mm_setzero_ps();
+        for (int t = 0; t < K::N; t++)
+        {
+            __m128 kv = _mm_set1_ps(Tap<K>(t));
+            s0 = _mm_add_ps(s0, _mm_mul_ps(kv, _mm_loadu_ps(&taps[t][j])));
+            s1 = _mm_add_ps(s1, _mm_mul_ps(kv, _mm_loadu_ps(&taps[t][j+4])));
+        }
+        _mm_storeu_ps(&dst[j],   s0);
+        _mm_storeu_ps(&dst[j+4], s1);
+    }
+#endif
+    for (; j < n; j++)
+    {
+        float sum = 0.0f;
+        for (int t = 0; t < K::N; t++)
+            sum += Tap<K>(t) * taps[t][j];
+        dst[j] = sum;
+    }
+}
+
+typedef void (*ConvolveTapsFn)(const float* const taps[], const float k[], ptrdiff_t kStride,
+                               int nTaps, float dst[], int n);
+
+static ConvolveTapsFn TapsFunction(const CFloatImage& kernel)
+{
+    if (IsKernel<CKernel121>(kernel))
+        return ConvolveTapsOf<CKernel121>;
+    if (IsKernel<CKernel1331>(kernel))
+        return ConvolveTapsOf<CKernel1331>;
+    if (IsKernel<CKernel14641>(kernel))
+        return ConvolveTapsOf<CKernel14641>;
+    if (IsKernel<CKernel8TapLowPass>(kernel))
+        return ConvolveTapsOf<CKernel8TapLowPass>;
+    return ConvolveTaps;
+}
+
+// dst[j] = (sum_t W[t] * taps[t][j]) >> shift in 16-bit integers, for
+// rows of byte values and the dyadic kernels with positive taps: the
+// sums stay below 256 << SHIFT, and the float code computes the same
+// sums exactly, and truncates them the same way
+
+template <class K>
+static void SumTapsOf(const short* const taps[], int shift, short dst[], int n)
+{
+    int j = 0;
+#ifdef CONVOLVE_SSE2
+    __m128i sh = _mm_cvtsi32_si128(shift);
+    for (; j + 8 <= n; j += 8)
+    {
+        __m128i s0 = _mm_setzero_si128();
+        for (int t = 0; t < K::N; t++)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *) &taps[t][j]);
+            s0 = _mm_add_epi16(s0, _mm_mullo_epi16(_mm_set1_epi16(K::W[t]), p));
+        }
+        _mm_storeu_si128((__m128i *) &dst[j], _mm_srl_epi16(s0, sh));
+    }
+#endif
+    for (; j < n; j++)
+    {
+        int sum = 0;
+        for (int t = 0; t < K::N; t++)
+            sum += K::W[t] * taps[t][j];
+        dst[j] = (short) (sum >> shift);
     }
 }
 
+typedef void (*SumTapsFn)(const short* const taps[], int shift, short dst[], int n);
+
+static SumTapsFn SumTapsFunction(const CFloatImage& kernel, int& shift)
+{
+    // (the 8-tap kernel has negative taps, and sums that overflow)
+    if (IsKernel<CKernel121>(kernel))
+    {
+        shift = CKernel121::SHIFT;
+        return SumTapsOf<CKernel121>;
+    }
+    if (IsKernel<CKernel1331>(kernel))
+    {
+        shift = CKernel1331::SHIFT;
+        return SumTapsOf<CKernel1331>;
+    }
+    if (IsKernel<CKernel14641>(kernel))
+    {
+        shift = CKernel14641::SHIFT;
+        return SumTapsOf<CKernel14641>;
+    }
+    return 0;
+}
+
 static
-void ConvolveRow2D(CFloatImage& buffer, CFloatImage& kernel, float dst[],
-                   int n)
+void ConvolveRow2D(const float* const rows[], const CFloatImage& kernel, float dst[],
+                   int n, int nB)
 {
     CShape kShape = kernel.Shape();
     int kX  = kShape.width;
     int kY  = kShape.height;
-    CShape bShape = buffer.Shape();
-    int nB  = bShape.nBands;
+    int nF  = n * nB;       // floats per output row
 
-    for (int i = 0; i < n; i++)
+    if (kX == 1 && kY > 1)
     {
-        for (int b = 0; b < nB; b++)
+        // vertical kernel: the sums stay in registers for all kernel rows
+        const float* k0 = &kernel.Pixel(0, 0, 0);
+        ConvolveTaps(rows, k0, &kernel.Pixel(0, 1, 0) - k0, kY, dst, nF);
+        return;
+    }
+
+    // horizontal or 2D kernel: accumulate one kernel row at a time
+    for (int k = 0; k < kY; k++)
+    {
+        const float* bPtr = rows[k];
+        const float* kPtr = &kernel.Pixel(0, k, 0);
+        switch (nB)
         {
-            float sum = 0.0f;
-            for (int k = 0; k < kY; k++)
-            {
-                float* kPtr = &kernel.Pixel(0, k, 0);
-                float* bPtr = &buffer.Pixel(i, k, b);
-                for (int l = 0; l < kX; l++, bPtr += nB)
-                    sum += kPtr[l] * bPtr[0];
-            }
-            *dst++ = sum;
+        case 1:  AccumulateRow<1>(bPtr, kPtr, kX, dst, nF, nB, k == 0); break;
+        case 2:  AccumulateRow<2>(bPtr, kPtr, kX, dst, nF, nB, k == 0); break;
+        case 3:  AccumulateRow<3>(bPtr, kPtr, kX, dst, nF, nB, k == 0); break;
+        case 4:  AccumulateRow<4>(bPtr, kPtr, kX, dst, nF, nB, k == 0); break;
+        default: AccumulateRow<0>(bPtr, kPtr, kX, dst, nF, nB, k == 0); break;
         }
     }
+    if (kY == 0)
+        memset(dst, 0, nF * sizeof(float));
+}
+
+static bool SharePixels(const CImage& a, const CImage& b)
+{
+    // Do the pixels of a and b overlap?
+    CShape sa = a.Shape(), sb = b.Shape();
+    if (sa.width == 0 || sa.height == 0 || sa.nBands == 0 ||
+        sb.width == 0 || sb.height == 0 || sb.nBands == 0)
+        return false;
+    const char* a0 = (const char *) a.PixelAddress(0, 0, 0);
+    const char* a1 = (const char *) a.PixelAddress(sa.width-1, sa.height-1, sa.nBands);
+    const char* b0 = (const char *) b.PixelAddress(0, 0, 0);
+    const char* b1 = (const char *) b.PixelAddress(sb.width-1, sb.height-1, sb.nBands);
+    return a0 < b1 && b0 < a1;
 }
 
 template <class T>
-void Convolve(CImageOf<T> src, CImageOf<T>& dst,
-              CFloatImage kernel,
-              float scale, float offset)
+static void ConvolveRows(const CImageOf<T>& src, CImageOf<T>& dst,
+                         const CFloatImage& kernel, const CRowFiller<T>& filler,
+                         float scale, float offset, T minVal, T maxVal,
+                         int y0, int y1)
 {
     // Determine the shape of the kernel and row buffer
     CShape kShape = kernel.Shape();
     CShape sShape = src.Shape();
     CShape bShape(sShape.width + kShape.width, kShape.height, sShape.nBands);
-    int bWidth = bShape.width * bShape.nBands;
-
-    // Allocate the result, if necessary, and the row buffer
-    dst.ReAllocate(sShape, false);
     CFloatImage buffer(bShape);
-    if (sShape.width * sShape.height * sShape.nBands == 0)
-        return;
     CFloatImage output(CShape(sShape.width, 1, sShape.nBands));
 
-    // Fill up the row buffer initially
+    // Fill up the row window initially: rows[k] holds the buffer row
+    // for kernel row k of the current output row
+    CSmallArray<float*> rows(kShape.height);
     for (int k = 0; k < kShape.height; k++)
-        FillRowBuffer(&buffer.Pixel(0, k, 0), src, kernel, k, bWidth);
-
-    // Determine if clipping is required
-    //  (we assume up-conversion to float never requires clipping, i.e.,
-    //   floats have the highest dynamic range)
-    T minVal = dst.MinVal();
-    T maxVal = dst.MaxVal();
-    if (minVal <= buffer.MinVal() && maxVal >= buffer.MaxVal())
-        minVal = maxVal = 0;
+    {
+        rows[k] = &buffer.Pixel(0, k, 0);
+        filler.Fill(rows[k], y0 + k);
+    }
 
     // Process each row
-    for (int y = 0; y < sShape.height; y++)
+    for (int y = y0; y < y1; y++)
     {
         // Do the convolution
-        ConvolveRow2D(buffer, kernel, &output.Pixel(0, 0, 0),
-                      sShape.width);
+        ConvolveRow2D(rows.Data(), kernel, &output.Pixel(0, 0, 0),
+                      sShape.width, sShape.nBands);
 
         // Scale, offset, and type convert
         ScaleAndOffsetLine(&output.Pixel(0, 0, 0), &dst.Pixel(0, y, 0),
                            sShape.width * sShape.nBands,
                            scale, offset, minVal, maxVal);
 
-        // Shift up the row buffer and fill the last line
-        if (y < sShape.height-1)
+        // Rotate the row window and fill the last line
+        // (the oldest buffer row is reused, nothing is copied)
+        if (y < y1-1 && kShape.height > 0)
         {
             int k;
+            float* oldest = rows[0];
             for (k = 0; k < kShape.height-1; k++)
-                memcpy(&buffer.Pixel(0, k, 0), &buffer.Pixel(0, k+1, 0),
-                       bWidth * sizeof(float));
-            FillRowBuffer(&buffer.Pixel(0, k, 0), src, kernel, y+k+1, bWidth);
+                rows[k] = rows[k+1];
+            rows[k] = oldest;
+            filler.Fill(oldest, y+k+1);
         }
     }
 }
 
 template <class T>
-void ConvolveSeparable(CImageOf<T> src, CImageOf<T>& dst,
-                       CFloatImage x_kernel, CFloatImage y_kernel,
-                       float scale, float offset,
-                       int decimate, int /*interpolate*/)
+void Convolve(const CImageOf<T>& src, CImageOf<T>& dst,
+              const CFloatImage& kernel,
+              float scale, float offset, int nThreads)
 {
     // Allocate the result, if necessary
-    CShape dShape = src.Shape();
-    if (decimate > 1)
+    CShape kShape = kernel.Shape();
+    CShape sShape = src.Shape();
+    if (sShape.width == 0 || sShape.height == 0 || sShape.nBands == 0)
     {
-        dShape.width  = (dShape.width  + decimate-1) / decimate;
-        dShape.height = (dShape.height + decimate-1) / decimate;
+        dst.ReAllocate(sShape, false);
+        return;
     }
-    dst.ReAllocate(dShape, false);
 
-    // Allocate the intermediate images
+    // Write into dst directly, unless it shares pixels with src (the row
+    // window reads rows below, and with some borders above, the output row)
+    bool inPlace = &src == &dst || (dst.Shape() == sShape && SharePixels(src, dst));
+    CImageOf<T> result;
+    CImageOf<T>& out = (inPlace) ? result : dst;
+    out.ReAllocate(sShape, false);
+
+    // Determine if clipping is required
+    //  (we assume up-conversion to float never requires clipping, i.e.,
+    //   floats have the highest dynamic range)
+    CFloatImage buffer;
+    T minVal = out.MinVal();
+    T maxVal = out.MaxVal();
+    if (minVal <= buffer.MinVal() && maxVal >= buffer.MaxVal())
+        minVal = maxVal = 0;
+
+    // Convolve each band of rows
+    CRowFiller<T> filler(src, kernel, sShape.width + kShape.width);
+    ParallelForBands(0, sShape.height, nThreads, [&](int y0, int y1) {
+        ConvolveRows(src, out, kernel, filler, scale, offset, minVal, maxVal, y0, y1);
+    });
+
+    if (inPlace)
+        CopyPixels(result, dst);
+}
+
+template <class T>
+static void ConvolveSeparableTwoPass(const CImageOf<T>& src, CImageOf<T>& dst,
+                                     const CFloatImage& x_kernel, const CFloatImage& y_kernel,
+                                     float scale, float offset, int decimate,
+                                     int nThreads)
+{
+    // Reference version for horizontal kernels with more than one row:
+    // convolve into two intermediate images, then decimate
+    CShape dShape = src.Shape();
+    dShape.width  = (dShape.width  + decimate-1) / decimate;
+    dShape.height = (dShape.height + decimate-1) / decimate;
     CImageOf<T> tmpImg1(src.Shape());
     CImageOf<T> tmpImg2(src.Shape());
-
-    // Create a proper vertical convolution kernel
     CFloatImage v_kernel(1, y_kernel.Shape().width, 1);
     for (int k = 0; k < y_kernel.Shape().width; k++)
         v_kernel.Pixel(0, k, 0) = y_kernel.Pixel(k, 0, 0);
     v_kernel.origin[1] = y_kernel.origin[0];
-
-    // Perform the two convolutions
-    Convolve(src, tmpImg1, x_kernel, 1.0f, 0.0f);
-    Convolve(tmpImg1, tmpImg2, v_kernel, scale, offset);
-
-    // Downsample or copy
-
-
-
-
-
-
+    Convolve(src, tmpImg1, x_kernel, 1.0f, 0.0f, nThreads);
+    Convolve(tmpImg1, tmpImg2, v_kernel, scale, offset, nThreads);
+    dst.ReAllocate(dShape, false);
     for (int y = 0; y < dShape.height; y++)
     {
         T* sPtr = &tmpImg2.Pixel(0, y * decimate, 0);
@@ -211,21 +632,241 @@ void ConvolveSeparable(CImageOf<T> src, CImageOf<T>& dst,
     }
 }
 
+// How ConvolveSeparableRows computes the two passes: on rows of floats
+// for any kernel, or on rows of shorts for byte images and the dyadic
+// default kernels (see SumTapsOf)
+
+template <class T>
+struct CSeparablePasses
+{
+    const CFloatImage* xKernel;
+    const CFloatImage* yKernel;
+    ConvolveTapsFn hTaps, vTaps;    // float rows
+    SumTapsFn hSum, vSum;           // short rows
+    int hShift, vShift;
+    float scale, offset;
+    T minVal, maxVal;
+};
+
+template <class T>
+static void HorizontalPass(const CSeparablePasses<T>& p, const float* const taps[],
+                           float dst[], T tmp[], int n)
+{
+    const CFloatImage& k = *p.xKernel;
+    p.hTaps(taps, &k.Pixel(0, 0, 0), 1, k.Shape().width, dst, n);
+
+    // round to the pixel type, like the intermediate image did
+    if (typeid(T) != typeid(float))
+    {
+        ScaleAndOffsetLine(dst, tmp, n, 1.0f, 0.0f, p.minVal, p.maxVal);
+        ConvertLine(tmp, dst, n);
+    }
+}
+
+template <class T>
+static void HorizontalPass(const CSeparablePasses<T>& p, const short* const taps[],
+                           short dst[], T* /*tmp*/, int n)
+{
+    p.hSum(taps, p.hShift, dst, n);     // rounded already
+}
+
 template <class T>
-void InstantiateConvolutionOf(CImageOf<T> img)
+static void VerticalPass(const CSeparablePasses<T>& p, const float* const taps[],
+                         float sum[], T dst[], int n)
+{
+    const CFloatImage& k = *p.yKernel;
+    p.vTaps(taps, &k.Pixel(0, 0, 0), 1, k.Shape().width, sum, n);
+    ScaleAndOffsetLine(sum, dst, n, p.scale, p.offset, p.minVal, p.maxVal);
+}
+
+template <class T>
+static void VerticalPass(const CSeparablePasses<T>& p, const short* const taps[],
+                         short sum[], T dst[], int n)
+{
+    if (p.scale == 1.0f && p.offset == 0.0f)
+    {
+        p.vSum(taps, p.vShift, sum, n);
+        ConvertLine(sum, dst, n);
+        return;
+    }
+
+    // scale the exact sums in float, a few at a time
+    p.vSum(taps, 0, sum, n);
+    const float unit = 1.0f / (1 << p.vShift);
+    float tmp[256];
+    for (int j = 0; j < n; j += 256)
+    {
+        int m = __min(256, n - j);
+        for (int i = 0; i < m; i++)
+            tmp[i] = sum[j + i] * unit;
+        ScaleAndOffsetLine(tmp, &dst[j], m, p.scale, p.offset, p.minVal, p.maxVal);
+    }
+}
+
+// Row type of the integer code: only byte images have one
+
+template <class T> struct CShortRows        { typedef float Type; };
+template <>        struct CShortRows<uchar> { typedef short Type; };
+
+template <class T, class B>
+static void ConvolveSeparableRows(const CImageOf<T>& src, CImageOf<T>& out,
+                                  const CSeparablePasses<T>& passes,
+                                  const CRowFiller<T>& filler,
+                                  int decimate, int y0, int y1)
 {
-    CFloatImage kernel;
-    Convolve(img, img, kernel, 1.0, 0.0);
-    ConvolveSeparable(img, img, kernel, kernel, 1.0, 0.0, 1, 1);
+    CShape sShape = src.Shape();
+    CShape dShape = out.Shape();
+    int nB = sShape.nBands;
+    int kX = passes.xKernel->Shape().width, kY = passes.yKernel->Shape().width;
+    int oY = passes.yKernel->origin[0];
+    int n = dShape.width * nB;              // values per output row
+
+    // Row buffers: the source row with its borders, the same row split
+    // into decimate phases (phase p holds the pixels p, p+decimate, ...),
+    // the ring, one vertical sum, and one rounded horizontal result
+    int nPhase = (sShape.width + kX + decimate-1) / decimate;  // pixels per phase
+    CImageOf<B> buffer(CShape(sShape.width + kX, 1, nB));
+    CImageOf<B> phases(CShape(nPhase, decimate, nB));
+    CImageOf<B> ring(CShape(dShape.width, kY, nB));
+    CImageOf<B> sum(CShape(dShape.width, 1, nB));
+    CImageOf<T> rounded(CShape(dShape.width, 1, nB));
+    CSmallArray<int> ringRow(kY);           // source row held by each ring slot
+    CSmallArray<const B*> taps(kX), vTaps(kY);  // kernel tap rows
+    for (int k = 0; k < kY; k++)
+        ringRow[k] = -1;
+
+    // the horizontal kernel tap l of output column x reads buffer pixel
+    // x*decimate + l, i.e., pixel x + l/decimate of phase l%decimate
+    B* bPtr = &buffer.Pixel(0, 0, 0);
+    for (int l = 0; l < kX; l++)
+    {
+        const B* pPtr = (decimate > 1) ? &phases.Pixel(0, l % decimate, 0) : bPtr;
+        taps[l] = pPtr + (l / decimate) * nB;
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        // Make sure the ring holds the source rows this output row needs
+        // (the first row of a band fills all of it)
+        for (int k = 0; k < kY; k++)
+        {
+            int r = __max(0, __min(sShape.height-1, y*decimate + k + oY));
+            if (ringRow[r % kY] != r)
+            {
+                filler.Fill(bPtr, r);
+                if (decimate > 1)
+                    for (int p = 0; p < decimate; p++)
+                    {
+                        B* pPtr = &phases.Pixel(0, p, 0);
+                        const B* sPtr = &bPtr[p*nB];
+                        for (int i = p; i < sShape.width + kX; i += decimate)
+                        {
+                            for (int b = 0; b < nB; b++)
+                                pPtr[b] = sPtr[b];
+                            pPtr += nB;
+                            sPtr += decimate * nB;
+                        }
+                    }
+                HorizontalPass(passes, taps.Data(), &ring.Pixel(0, r % kY, 0),
+                               &rounded.Pixel(0, 0, 0), n);
+                ringRow[r % kY] = r;
+            }
+        }
+
+        // Vertical pass, then scale, offset, and type convert into out
+        for (int k = 0; k < kY; k++)
+        {
+            int r = __max(0, __min(sShape.height-1, y*decimate + k + oY));
+            vTaps[k] = &ring.Pixel(0, r % kY, 0);
+        }
+        VerticalPass(passes, vTaps.Data(), &sum.Pixel(0, 0, 0), &out.Pixel(0, y, 0), n);
+    }
 }
 
-void InstantiateConvolutions()
+template <class T>
+void ConvolveSeparable(const CImageOf<T>& src, CImageOf<T>& dst,
+                       const CFloatImage& x_kernel, const CFloatImage& y_kernel,
+                       float scale, float offset,
+                       int decimate, int /*interpolate*/, int nThreads)
 {
-    InstantiateConvolutionOf(CByteImage());
-    InstantiateConvolutionOf(CIntImage());
-    InstantiateConvolutionOf(CFloatImage());
+    if (decimate < 1)
+        decimate = 1;
+    if (x_kernel.Shape().height != 1)
+    {
+        ConvolveSeparableTwoPass(src, dst, x_kernel, y_kernel, scale, offset,
+                                 decimate, nThreads);
+        return;
+    }
+
+    // Determine the shape of the result
+    CShape sShape = src.Shape();
+    CShape dShape = sShape;
+    dShape.width  = (dShape.width  + decimate-1) / decimate;
+    dShape.height = (dShape.height + decimate-1) / decimate;
+
+    // Write into dst directly, unless it shares pixels with src
+    bool inPlace = &src == &dst || (dst.Shape() == dShape && SharePixels(src, dst));
+    CImageOf<T> result;
+    CImageOf<T>& out = (inPlace) ? result : dst;
+    out.ReAllocate(dShape, false);
+    if (dShape.width == 0 || dShape.height == 0 || dShape.nBands == 0)
+    {
+        dst.ReAllocate(dShape, false);
+        return;
+    }
+
+    // Clipping as in Convolve (never needed for float)
+    CFloatImage buffer;
+    CSeparablePasses<T> passes;
+    passes.minVal = out.MinVal();
+    passes.maxVal = out.MaxVal();
+    if (passes.minVal <= buffer.MinVal() && passes.maxVal >= buffer.MaxVal())
+        passes.minVal = passes.maxVal = 0;
+
+    // Use the compile-time taps of the default kernels, and integer
+    // rows for byte images when both kernels allow it
+    passes.xKernel = &x_kernel;
+    passes.yKernel = &y_kernel;
+    passes.hTaps = TapsFunction(x_kernel);
+    passes.vTaps = TapsFunction(y_kernel);
+    passes.hSum = SumTapsFunction(x_kernel, passes.hShift);
+    passes.vSum = SumTapsFunction(y_kernel, passes.vShift);
+    passes.scale = scale;
+    passes.offset = offset;
+    bool shortRows = typeid(T) == typeid(uchar) && passes.hSum && passes.vSum;
+
+    // Convolve each band of output rows
+    CRowFiller<T> filler(src, x_kernel, sShape.width + x_kernel.Shape().width);
+    ParallelForBands(0, dShape.height, nThreads, [&](int y0, int y1) {
+        if (shortRows)
+            ConvolveSeparableRows<T, typename CShortRows<T>::Type>(src, out, passes, filler,
+                                                                   decimate, y0, y1);
+        else
+            ConvolveSeparableRows<T, float>(src, out, passes, filler, decimate, y0, y1);
+    });
+
+    if (inPlace)
+    {
+        dst.ReAllocate(dShape, false);
+        CopyPixels(result, dst);
+    }
 }
 
+// explicit instantiation (calling the templates from a dummy function
+// does not keep the symbols once the optimizer inlines the calls)
+#define InstantiateConvolutionOf(T) \
+template void Convolve(const CImageOf<T>& src, CImageOf<T>& dst, \
+                       const CFloatImage& kernel, float scale, float offset, \
+                       int nThreads); \
+template void ConvolveSeparable(const CImageOf<T>& src, CImageOf<T>& dst, \
+                                const CFloatImage& xKernel, const CFloatImage& yKernel, \
+                                float scale, float offset, int decimate, int interpolate, \
+                                int nThreads)
+
+InstantiateConvolutionOf(uchar);
+InstantiateConvolutionOf(int);
+InstantiateConvolutionOf(float);
+
 //
 //  Default kernels
 //
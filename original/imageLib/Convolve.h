@@ -4,13 +4,13 @@
 //  Convolve.h -- separable and non-separable linear convolution
 //
 // SPECIFICATION
-//  void Convolve(CImageOf<T> src, CImageOf<T>& dst,
-//                CFloatImage kernel,
-//                int decimate, int interpolate);
+//  void Convolve(const CImageOf<T>& src, CImageOf<T>& dst,
+//                const CFloatImage& kernel,
+//                int decimate, int interpolate, int nThreads = 0);
 //
-//  void ConvolveSeparable(CImageOf<T> src, CImageOf<T>& dst,
-//                         CFloatImage xKernel, CFloatImage yKernel,
-//                         int decimate, int interpolate);
+//  void ConvolveSeparable(const CImageOf<T>& src, CImageOf<T>& dst,
+//                         const CFloatImage& xKernel, const CFloatImage& yKernel,
+//                         int decimate, int interpolate, int nThreads = 0);
 //
 // PARAMETERS
 //  src                 source image
@@ -19,6 +19,7 @@
 //  xKernel, yKernel    1-D convolution kernels (1-row images)
 //  decimate            decimation factor (1 = none, 2 = half, ...)
 //  interpolate			interpolation factor (1 = none, 2 = double, ...)
+//  nThreads            number of threads (0 = ThreadCount(), see Parallel.h)
 //
 // DESCRIPTION
 //  Perform a 2D or separable 1D convolution.  The convolution kernels
@@ -36,6 +37,10 @@
 //  The padding type of src (src.borderMode) determines how pixels are
 //  filled for convolutions.
 //
+//  With more than one thread, the output rows are split into one band
+//  per thread, and each thread has its own row buffers.  The results do
+//  not depend on the number of threads.
+//
 // SEE ALSO
 //  Convolve.cpp        implementation
 //  Image.h             image class definition
@@ -46,16 +51,16 @@
 ///////////////////////////////////////////////////////////////////////////
 
 template <class T>
-void Convolve(CImageOf<T> src, CImageOf<T>& dst,
-              CFloatImage kernel,
-              float scale, float offset);
+void Convolve(const CImageOf<T>& src, CImageOf<T>& dst,
+              const CFloatImage& kernel,
+              float scale, float offset, int nThreads = 0);
 
 
 template <class T>
-void ConvolveSeparable(CImageOf<T> src, CImageOf<T>& dst,
-                       CFloatImage x_kernel, CFloatImage y_kernel,
+void ConvolveSeparable(const CImageOf<T>& src, CImageOf<T>& dst,
+                       const CFloatImage& x_kernel, const CFloatImage& y_kernel,
                        float scale, float offset,
-                       int decimate, int interpolate);
+                       int decimate, int interpolate, int nThreads = 0);
 
 extern CFloatImage ConvolveKernel_121;
 extern CFloatImage ConvolveKernel_1331;
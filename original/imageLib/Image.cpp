@@ -13,6 +13,24 @@
 
 #include "Image.h"
 #include "Error.h"
+#include <utility>
+#include <mutex>
+#include <map>
+#include <vector>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#ifndef IMAGE_ALIGNMENT
+#define IMAGE_ALIGNMENT 64      // default row alignment: one cache line
+#endif
+#define HUGE_PAGE_SIZE (2 << 20)
+
+#ifndef IMAGE_POOL_LIMIT
+#define IMAGE_POOL_LIMIT (256 << 20)    // default max. bytes held by the pool
+#endif
 
 //
 // struct CShape: shape of image (width x height x nbands)
@@ -40,6 +58,261 @@ bool CShape::operator!=(const CShape& ref)
 }
 
 
+//
+// struct CImageAllocPolicy: how CImage allocates pixel memory
+//
+
+static CImageAllocPolicy globalAllocPolicy(IMAGE_ALIGNMENT, 0);
+
+static void CheckAlignment(int a, const char *caller)
+{
+    if (a < 8 || (a & (a - 1)) != 0)
+        throw CError("%s: alignment %d is not a power of 2 >= 8", caller, a);
+}
+
+void SetImageAllocPolicy(const CImageAllocPolicy& policy)
+{
+    // Set the policy of all images that do not have their own
+    int a = policy.alignment ? policy.alignment : IMAGE_ALIGNMENT;
+    CheckAlignment(a, "SetImageAllocPolicy");
+    globalAllocPolicy = CImageAllocPolicy(a, policy.hugePageBytes, policy.pooled);
+}
+
+CImageAllocPolicy ImageAllocPolicy()
+{
+    return globalAllocPolicy;
+}
+
+static void FreeImageMemory(void *ptr)
+{
+    // Delete function for memory allocated by AllocateImageMemory
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+static bool UseHugePages(size_t nBytes, const CImageAllocPolicy& policy)
+{
+    // Whether AllocateImageMemory backs nBytes with huge pages
+#ifdef MADV_HUGEPAGE
+    return policy.hugePageBytes > 0 && nBytes >= policy.hugePageBytes;
+#else
+    return false;
+#endif
+}
+
+static void *AllocateImageMemory(size_t nBytes, const CImageAllocPolicy& policy)
+{
+    // Allocate nBytes aligned as requested by the policy (0 on failure)
+    size_t alignment = policy.alignment;
+    bool huge = UseHugePages(nBytes, policy);
+#ifdef MADV_HUGEPAGE
+    if (huge)   // whole huge pages, so madvise covers the buffer
+    {
+        alignment = __max(alignment, (size_t) HUGE_PAGE_SIZE);
+        nBytes = (nBytes + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+    }
+#endif
+    void *memory;
+#ifdef _WIN32
+    memory = _aligned_malloc(nBytes, alignment);
+#else
+    if (posix_memalign(&memory, alignment, nBytes) != 0)
+        memory = 0;
+#endif
+#ifdef MADV_HUGEPAGE
+    if (memory && huge)
+        madvise(memory, nBytes, MADV_HUGEPAGE);     // only a hint: ignore errors
+#endif
+    return memory;
+}
+
+
+//
+// class CImagePool: recycles released pixel buffers
+//
+//  Buffer sizes are rounded up to size classes (1/8 of the enclosing
+//  power of 2, so at most 12.5% is wasted).  Each buffer is preceded by
+//  a header that records its size class, so that the delete function
+//  (which only gets the buffer pointer) can put it on the right free list.
+//  Buffers with and without huge pages are kept on separate lists, so a
+//  recycled buffer always matches the policy it is handed out under.
+//
+
+struct CPoolHeader          // stored just before the pooled buffer
+{
+    size_t classBytes;      // size class (usable bytes)
+    int headerBytes;        // offset of the buffer from the allocation
+    bool huge;              // backed by huge pages
+};
+
+class CImagePool
+{
+public:
+    CImagePool() : m_limit(IMAGE_POOL_LIMIT)
+    {
+        m_stats.hits = m_stats.misses = m_stats.nFree = m_stats.freeBytes = 0;
+    }
+
+    void* Allocate(size_t nBytes, const CImageAllocPolicy& policy);
+    void Release(void *memory);
+    CImagePoolStats Stats();
+    void SetLimit(size_t nBytes);
+    void Shrink(size_t nBytes);             // free buffers down to nBytes held
+
+private:
+    struct CKey                             // free list of a buffer
+    {
+        size_t classBytes;                  // size class
+        int headerBytes;                    // header size
+        bool huge;                          // backed by huge pages
+        CKey(size_t c, int h, bool hp) : classBytes(c), headerBytes(h), huge(hp) {}
+        bool operator<(const CKey& k) const
+        {
+            if (classBytes != k.classBytes)
+                return classBytes < k.classBytes;
+            if (headerBytes != k.headerBytes)
+                return headerBytes < k.headerBytes;
+            return huge < k.huge;
+        }
+    };
+
+    std::mutex m_mutex;                     // guards everything below
+    std::map<CKey, std::vector<void *> > m_free;    // free buffers per class
+    CImagePoolStats m_stats;
+    size_t m_limit;                         // max. m_stats.freeBytes
+};
+
+static size_t PoolSizeClass(size_t nBytes)
+{
+    // Round up to 1/8 of the enclosing power of 2 (and to 64 bytes)
+    size_t p = 64;
+    while (p * 2 <= nBytes)
+        p *= 2;
+    size_t step = __max(p / 8, (size_t) 64);
+    return (nBytes + step - 1) & ~(step - 1);
+}
+
+static CPoolHeader* PoolHeader(void *memory)
+{
+    return (CPoolHeader *) ((char *) memory - sizeof(CPoolHeader));
+}
+
+void* CImagePool::Allocate(size_t nBytes, const CImageAllocPolicy& policy)
+{
+    // the header keeps the buffer aligned
+    int headerBytes = __max(policy.alignment, 64);
+    size_t classBytes = PoolSizeClass(nBytes);
+    CKey key(classBytes, headerBytes,
+             UseHugePages(classBytes + headerBytes, policy));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<CKey, std::vector<void *> >::iterator it = m_free.find(key);
+        if (it != m_free.end() && ! it->second.empty())
+        {
+            void *memory = it->second.back();
+            it->second.pop_back();
+            m_stats.hits++;
+            m_stats.nFree--;
+            m_stats.freeBytes -= key.classBytes;
+            return memory;
+        }
+        m_stats.misses++;
+    }
+    char *block = (char *) AllocateImageMemory(classBytes + headerBytes, policy);
+    if (block == 0)
+        return 0;
+    void *memory = block + headerBytes;
+    PoolHeader(memory)->classBytes = classBytes;
+    PoolHeader(memory)->headerBytes = headerBytes;
+    PoolHeader(memory)->huge = key.huge;
+    return memory;
+}
+
+void CImagePool::Release(void *memory)
+{
+    CPoolHeader *h = PoolHeader(memory);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stats.freeBytes + h->classBytes <= m_limit)
+        {
+            m_free[CKey(h->classBytes, h->headerBytes, h->huge)].push_back(memory);
+            m_stats.nFree++;
+            m_stats.freeBytes += h->classBytes;
+            return;
+        }
+    }
+    FreeImageMemory((char *) memory - h->headerBytes);  // pool is full
+}
+
+CImagePoolStats CImagePool::Stats()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void CImagePool::SetLimit(size_t nBytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_limit = nBytes;
+    }
+    Shrink(nBytes);     // drop the buffers that no longer fit
+}
+
+void CImagePool::Shrink(size_t nBytes)
+{
+    std::vector<void *> drop;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<CKey, std::vector<void *> >::iterator it = m_free.begin();
+        for (; it != m_free.end() && m_stats.freeBytes > nBytes; it++)
+        {
+            while (! it->second.empty() && m_stats.freeBytes > nBytes)
+            {
+                drop.push_back(it->second.back());
+                it->second.pop_back();
+                m_stats.nFree--;
+                m_stats.freeBytes -= it->first.classBytes;
+            }
+        }
+    }
+    for (size_t i = 0; i < drop.size(); i++)
+        FreeImageMemory((char *) drop[i] - PoolHeader(drop[i])->headerBytes);
+}
+
+static CImagePool& ImagePool()
+{
+    // never destroyed: static images may be released after exit() has
+    // run the destructors of this file
+    static CImagePool *pool = new CImagePool;
+    return *pool;
+}
+
+static void ReleasePooledMemory(void *memory)
+{
+    // Delete function for memory allocated by CImagePool::Allocate
+    ImagePool().Release(memory);
+}
+
+CImagePoolStats ImagePoolStats()
+{
+    return ImagePool().Stats();
+}
+
+void SetImagePoolLimit(size_t nBytes)
+{
+    ImagePool().SetLimit(nBytes);
+}
+
+void ImagePoolTrim()
+{
+    ImagePool().Shrink(0);
+}
+
+
 //
 // class CImage : generic (weakly typed) image
 //
@@ -73,6 +346,50 @@ CImage::CImage(CShape s, const type_info& ti, int cS)
     ReAllocate(s, ti, cS, 0, true, 0);
 }
 
+CImage::CImage(CImage&& ref) :
+    CImageAttributes(ref), m_memory(std::move(ref.m_memory))
+{
+    // Move constructor: no reference count traffic
+    MoveFrom(ref);
+}
+
+CImage& CImage::operator=(CImage&& ref)
+{
+    // Move assignment: release our memory, take over the one of ref
+    if (this != &ref)
+    {
+        CImageAttributes::operator=(ref);
+        m_memory = std::move(ref.m_memory);
+        MoveFrom(ref);
+    }
+    return *this;
+}
+
+void CImage::MoveFrom(CImage& ref)
+{
+    // Copy the remaining state of ref (its memory has been moved already)
+    // and leave it empty, with the same pixel type
+    m_shape     = ref.m_shape;
+    m_pTI       = ref.m_pTI;
+    m_bandSize  = ref.m_bandSize;
+    m_pixSize   = ref.m_pixSize;
+    m_rowSize   = ref.m_rowSize;
+    m_memStart  = ref.m_memStart;
+    m_allocPolicy = ref.m_allocPolicy;
+    alphaChannel = ref.alphaChannel;
+    ref.m_shape = CShape();
+    ref.m_pixSize = ref.m_rowSize = 0;
+    ref.m_memStart = 0;
+}
+
+void CImage::SetAllocPolicy(const CImageAllocPolicy& policy)
+{
+    // Policy for the next allocations of this image (alignment 0 = global)
+    if (policy.alignment)
+        CheckAlignment(policy.alignment, "CImage::SetAllocPolicy");
+    m_allocPolicy = policy;
+}
+
 void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
                         bool evenIfSameShape)
 {
@@ -82,7 +399,8 @@ void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
 }
 
 void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
-                        void *memory, bool deleteWhenDone, int rowSize)
+                        void *memory, bool deleteWhenDone, ptrdiff_t rowSize,
+                        void (*deleteFunction)(void *ptr), void *deleteArg)
 {
     // Set up the type_id, shape, and size info
     m_shape     = s;                        // image shape (dimensions)
@@ -91,17 +409,31 @@ void CImage::ReAllocate(CShape s, const type_info& ti, int bandSize,
     m_pixSize   = m_bandSize * s.nBands;    // stride between pixels in bytes
 
     // Do the real allocation work
+    CImageAllocPolicy policy = (m_allocPolicy.alignment) ?
+        m_allocPolicy : globalAllocPolicy;
+    if (policy.alignment == 0)
+        policy.alignment = IMAGE_ALIGNMENT;
+    ptrdiff_t align = (memory) ? 8 : policy.alignment;
     m_rowSize   = (rowSize) ? rowSize :     // stride between rows in bytes
-        (m_pixSize * s.width + 7) & -8;     // round up to 8 (quadwords)
-    int nBytes  = m_rowSize * s.height;
+        (m_pixSize * s.width + align - 1) & -align; // round up to the alignment
+    size_t nBytes = (size_t) m_rowSize * s.height;
     if (memory == 0 && nBytes > 0)          // allocate if necessary
     {
-        memory = new double[(nBytes + 7)/ 8];
+        memory = (policy.pooled) ? ImagePool().Allocate(nBytes, policy) :
+            AllocateImageMemory(nBytes, policy);
         if (memory == 0)
-            throw CError("CImage::Reallocate: could not allocate %d bytes", nBytes);
+        {
+            char size[32];      // exact, even beyond the precision of a float
+            snprintf(size, sizeof(size), "%zu", nBytes);
+            throw CError("CImage::Reallocate: could not allocate %s bytes", size);
+        }
+        deleteWhenDone = true;
+        deleteFunction = (policy.pooled) ? ReleasePooledMemory : FreeImageMemory;
+        deleteArg = 0;
     }
     m_memStart = (char *) memory;           // start of addressable memory
-    m_memory.ReAllocate(nBytes, memory, deleteWhenDone);
+    m_memory.ReAllocate(nBytes, memory, deleteWhenDone,
+                        deleteFunction, deleteArg);
 }
 
 void CImage::DeAllocate()
@@ -137,7 +469,7 @@ void CImage::SetPixels(void *val_ptr)
         all_same = all_same && (vc[b] == vc[0]);
 
     // Iterate over the rows
-    int nC = m_shape.width * m_shape.nBands;
+    size_t nC = (size_t) m_shape.width * m_shape.nBands;
     for (int y = 0; y < m_shape.height; y++)
     {
         uchar *rp = (uchar *) PixelAddress(0, y, 0);
@@ -147,12 +479,12 @@ void CImage::SetPixels(void *val_ptr)
         {
             int vi = *(int *) val_ptr;
             int *ip = (int *) rp;
-            for (int c = 0; c < nC; c++)
+            for (size_t c = 0; c < nC; c++)
                 ip[c] = vi;
         }
         else
         {
-            for (int c = 0; c < nC; c++, rp += m_bandSize)
+            for (size_t c = 0; c < nC; c++, rp += m_bandSize)
                 memcpy(rp, vc, m_bandSize);
         }
     }
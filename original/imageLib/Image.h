@@ -21,6 +21,18 @@
 //  construction share memory (to copy pixel values from one image to
 //  another one, use CopyPixels()).
 //
+//  Pixel memory allocated by CImage follows an allocation policy
+//  (CImageAllocPolicy): by default the buffer and every row start on a
+//  64-byte boundary, so SIMD kernels can use aligned loads on rows of
+//  freshly allocated images (not of sub-images or wrapped memory).  Large
+//  buffers can optionally be backed by huge pages.  The policy is set
+//  globally with SetImageAllocPolicy() or per image with SetAllocPolicy().
+//
+//  Released pixel buffers go to a pool (bucketed by size) and are handed
+//  out again by the next allocation of a similar size, so that processing
+//  a stream of same-sized frames does not touch the heap once the pool
+//  is warm.  ImagePoolStats() reports hits and misses.
+//
 // SEE ALSO
 //  Image.cpp           implementation
 //  RefCntMem.h         reference-counted memory object used by CImage
@@ -36,6 +48,7 @@ using namespace std;
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string>
 #include "RefCntMem.h"
 
@@ -110,6 +123,42 @@ struct CImageAttributes
 };
 
 
+// Allocation policy for pixel memory allocated by CImage
+
+struct CImageAllocPolicy
+{
+    int alignment;          // alignment of the buffer and of each row in bytes
+                            // (a power of 2, >= 8); 0 = use the global policy
+    size_t hugePageBytes;   // ask for huge pages (madvise, Linux only) for
+                            // buffers of at least this size; 0 = never
+    bool pooled;            // recycle the memory through the buffer pool
+
+    // constexpr, so that the global default is set before any static
+    // initializer (e.g., a global image) can allocate
+    constexpr CImageAllocPolicy(int align = 0, size_t hugeBytes = 0, bool pool = true) :
+        alignment(align), hugePageBytes(hugeBytes), pooled(pool) {}
+};
+
+// The global policy is not guarded by a lock:  call SetImageAllocPolicy
+// before starting any threads that allocate images.
+void SetImageAllocPolicy(const CImageAllocPolicy& policy);  // global policy
+CImageAllocPolicy ImageAllocPolicy(void);       // (default: 64-byte alignment)
+
+// Buffer pool for pixel memory
+
+struct CImagePoolStats
+{
+    size_t hits;            // allocations served from the pool
+    size_t misses;          // allocations that had to go to the heap
+    size_t nFree;           // buffers currently held by the pool
+    size_t freeBytes;       // bytes currently held by the pool
+};
+
+CImagePoolStats ImagePoolStats(void);
+void SetImagePoolLimit(size_t nBytes);  // max. bytes held (default 256 MB)
+void ImagePoolTrim(void);               // free all buffers held by the pool
+
+
 // Generic (weakly typed) image
 
 class CImage : public CImageAttributes
@@ -117,19 +166,29 @@ class CImage : public CImageAttributes
 public:
     CImage(void);               // default constructor
     CImage(CShape s, const type_info& ti, int bandSize);
-    // uses system-supplied copy constructor, assignment operator, and destructor
+    CImage(const CImage& ref) = default;            // shares the memory of ref
+    CImage& operator=(const CImage& ref) = default; // shares the memory of ref
+    CImage(CImage&& ref);               // takes over the memory of ref, which is
+    CImage& operator=(CImage&& ref);    // left empty (same pixel type, no pixels)
 
     void ReAllocate(CShape s, const type_info& ti, int bandSize,
-                    void *memory, bool deleteWhenDone, int rowSize);
+                    void *memory, bool deleteWhenDone, ptrdiff_t rowSize,
+                    void (*deleteFunction)(void *ptr) = 0,
+                    void *deleteArg = 0);
     void ReAllocate(CShape s, const type_info& ti, int bandSize,
                     bool evenIfSameShape = false);
     void DeAllocate(void);      // release the memory & set to default values
 
-    CShape Shape(void)              { return m_shape; }
-    const type_info& PixType(void)  { return *m_pTI; }
-    int BandSize(void)              { return m_bandSize; }
+    void SetAllocPolicy(const CImageAllocPolicy& policy);
+        // policy for the next allocations of this image (not of wrapped memory)
+    CImageAllocPolicy AllocPolicy(void) const  { return m_allocPolicy; }
+
+    CShape Shape(void) const              { return m_shape; }
+    const type_info& PixType(void) const  { return *m_pTI; }
+    int BandSize(void) const              { return m_bandSize; }
 
     void* PixelAddress(int x, int y, int band);
+    const void* PixelAddress(int x, int y, int band) const;
 
     void SetSubImage(int xO, int yO, int width, int height);   // sub-image sharing memory
 
@@ -138,14 +197,16 @@ protected:
 
 private:
     void SetDefaults(void); // set internal state to default values
+    void MoveFrom(CImage& ref); // take over the state of ref (after m_memory)
 
     CShape m_shape;         // image shape (dimensions)
     const type_info* m_pTI; // pointer to type_info class
     int m_bandSize;         // size of each band in bytes
-    int m_pixSize;          // stride between pixels in bytes
-    int m_rowSize;          // stride between rows in bytes
+    ptrdiff_t m_pixSize;    // stride between pixels in bytes
+    ptrdiff_t m_rowSize;    // stride between rows in bytes
     char* m_memStart;       // start of addressable memory
     CRefCntMem m_memory;    // reference counted memory
+    CImageAllocPolicy m_allocPolicy;    // per-image allocation policy
 public:
     int alphaChannel;       // which channel contains alpha (for compositing)
 };
@@ -156,6 +217,11 @@ inline void* CImage::PixelAddress(int x, int y, int band)
     return (void *) &m_memStart[y * m_rowSize + x * m_pixSize + band * m_bandSize];
 }
 
+inline const void* CImage::PixelAddress(int x, int y, int band) const
+{
+    return (const void *) &m_memStart[y * m_rowSize + x * m_pixSize + band * m_bandSize];
+}
+
 
 //  Strongly typed image
 
@@ -166,12 +232,16 @@ public:
     CImageOf(void);
     CImageOf(CShape s);
     CImageOf(int width, int height, int nBands);
-    // uses system-supplied copy constructor, assignment operator, and destructor
+    // uses system-supplied copy and move constructors, assignment operators,
+    // and destructor (see CImage)
 
     void ReAllocate(CShape s, bool evenIfSameShape = false);
-    void ReAllocate(CShape s, T *memory, bool deleteWhenDone, int rowSize);
+    void ReAllocate(CShape s, T *memory, bool deleteWhenDone, ptrdiff_t rowSize,
+                    void (*deleteFunction)(void *ptr) = 0,
+                    void *deleteArg = 0);
 
     T& Pixel(int x, int y, int band);
+    const T& Pixel(int x, int y, int band) const;
 
     CImageOf SubImage(int x, int y, int width, int height);   // sub-image sharing memory
 
@@ -204,9 +274,12 @@ inline void CImageOf<T>::ReAllocate(CShape s, bool evenIfSameShape)
 
 template <class T>
 inline void CImageOf<T>::ReAllocate(CShape s, T *memory,
-                                    bool deleteWhenDone, int rowSize)
+                                    bool deleteWhenDone, ptrdiff_t rowSize,
+                                    void (*deleteFunction)(void *ptr),
+                                    void *deleteArg)
 {
-    CImage::ReAllocate(s, typeid(T), sizeof(T), memory, deleteWhenDone, rowSize);
+    CImage::ReAllocate(s, typeid(T), sizeof(T), memory, deleteWhenDone, rowSize,
+                       deleteFunction, deleteArg);
 }
     
 template <class T>
@@ -215,6 +288,12 @@ inline T& CImageOf<T>::Pixel(int x, int y, int band)
     return *(T *) PixelAddress(x, y, band);
 }
 
+template <class T>
+inline const T& CImageOf<T>::Pixel(int x, int y, int band) const
+{
+    return *(const T *) PixelAddress(x, y, band);
+}
+
 template <class T>
 inline CImageOf<T> CImageOf<T>::SubImage(int x, int y, int width, int height)
 {
@@ -34,7 +34,7 @@
 #ifdef HAVE_PNG_LIB
 // implemented in ImageIOpng.cpp
 void ReadFilePNG(CByteImage& img, const char* filename);
-void WriteFilePNG(CByteImage img, const char* filename);
+void WriteFilePNG(const CByteImage& img, const char* filename, const CPngOptions& png);
 #endif
 
 
@@ -245,7 +245,7 @@ void ReadFileTGA(CByteImage& img, const char* filename)
         throw CError("ReadFileTGA(%s): error closing file", filename);
 }
 
-void WriteFileTGA(CImage img, const char* filename)
+void WriteFileTGA(const CImage& img, const char* filename)
 {
     // Only 1, 3, or 4 bands supported
     CShape sh = img.Shape();
@@ -284,7 +284,7 @@ void WriteFileTGA(CImage img, const char* filename)
     for (int y = 0; y < sh.height; y++)
     {
         int yr = reverseRows ? sh.height-1-y : y;
-        char* ptr = (char *) img.PixelAddress(0, yr, 0);
+        const char* ptr = (const char *) img.PixelAddress(0, yr, 0);
         int n = sh.width*sh.nBands;
     	if ((int)fwrite(ptr, sizeof(uchar), n, stream) != n)
     	    throw CError("WriteFileTGA(%s): file is too short", filename);
@@ -424,7 +424,7 @@ void ReadFilePGM(CByteImage& img, const char* filename)
 
 
 
-void WriteFilePGM(CByteImage img, const char* filename)
+void WriteFilePGM(const CByteImage& img, const char* filename)
 {
     // Write a PGM, PPM, or PMF file
     CShape sh = img.Shape();
@@ -455,7 +455,7 @@ void WriteFilePGM(CByteImage img, const char* filename)
 		// write the rows
         int n = isFloat ? sh.width * sh.nBands * sizeof(float) : sh.width;
 		for (int y = 0; y<sh.height; y++) {
-			char* ptr = (char *) img.PixelAddress(0, y, 0);
+			const char* ptr = (const char *) img.PixelAddress(0, y, 0);
     		if ((int)fwrite(ptr, sizeof(uchar), n, stream) != n)
     			throw CError("WriteFilePGM(%s): file is too short", filename);
 		}
@@ -576,7 +576,13 @@ void ReadImage (CImage& img, const char* filename)
 
 
 
-void WriteImage(CImage& img, const char* filename)
+void WriteImage(const CImage& img, const char* filename)
+{
+    WriteImage(img, filename, CPngOptions());
+}
+
+// the PNG options are ignored by the other formats
+void WriteImage(const CImage& img, const char* filename, const CPngOptions& png)
 {
     if (filename == NULL)
 	throw CError("WriteImage: empty filename");
@@ -589,7 +595,7 @@ void WriteImage(CImage& img, const char* filename)
     if (strcmp(dot, ".TGA") == 0 || strcmp(dot, ".tga") == 0)
     {
         if (img.PixType() == typeid(uchar))
-            WriteFileTGA(*(CByteImage *) &img, filename);
+            WriteFileTGA(*(const CByteImage *) &img, filename);
         else
            throw CError("WriteImage(%s): can only write CByteImage in TGA format", filename);
     }
@@ -598,7 +604,7 @@ void WriteImage(CImage& img, const char* filename)
     {
         if (img.PixType() == typeid(uchar) ||
             img.PixType() == typeid(float))
-            WriteFilePGM(*(CByteImage *) &img, filename);
+            WriteFilePGM(*(const CByteImage *) &img, filename);
         else
            throw CError("WriteImage(%s): wrong image type for PGM/PPM/PMF", filename);
     }
@@ -606,7 +612,7 @@ void WriteImage(CImage& img, const char* filename)
     else if (strcmp(dot, ".PNG") == 0 || strcmp(dot, ".png") == 0)
     {
         if (img.PixType() == typeid(uchar))
-            WriteFilePNG(*(CByteImage *) &img, filename);
+            WriteFilePNG(*(const CByteImage *) &img, filename, png);
         else
            throw CError("WriteImage(%s): can only write CByteImage in PNG format", filename);
     }
@@ -615,6 +621,56 @@ void WriteImage(CImage& img, const char* filename)
         throw CError("WriteImage(%s): file type not supported", filename);
 }
 
+//
+// PNG encoding options
+//
+
+CPngOptions::CPngOptions(EPngPreset preset)
+{
+    strategy = ePngStrategyDefault;
+    filter = ePngFilterAdaptive;
+    nThreads = 1;
+    switch (preset)
+    {
+    case ePngFastest:
+        level = 0;
+        filter = ePngFilterNone;
+        break;
+    case ePngFast:
+        level = 1;
+        strategy = ePngStrategyRLE;
+        filter = ePngFilterUp;
+        break;
+    case ePngSmallest:
+        level = 9;
+        break;
+    default:
+        level = -1;
+        break;
+    }
+}
+
+CPngOptions CPngOptions::FromName(const char* name)
+{
+    // "fastest", "fast", "default", "smallest", or a zlib level 0..9
+    if (strcmp(name, "fastest") == 0)
+        return CPngOptions(ePngFastest);
+    if (strcmp(name, "fast") == 0)
+        return CPngOptions(ePngFast);
+    if (strcmp(name, "default") == 0)
+        return CPngOptions(ePngDefault);
+    if (strcmp(name, "smallest") == 0)
+        return CPngOptions(ePngSmallest);
+    if (name[0] >= '0' && name[0] <= '9' && name[1] == 0)
+    {
+        CPngOptions png;
+        png.level = name[0] - '0';
+        return png;
+    }
+    throw CError("CPngOptions: unknown png preset %s "
+                 "(use fastest, fast, default, smallest or 0..9)", name);
+}
+
 // read an image and perhaps tell the user you're doing so
 void ReadImageVerb(CImage& img, const char* filename, int verbose) {
 	if (verbose)
@@ -623,8 +679,15 @@ void ReadImageVerb(CImage& img, const char* filename, int verbose) {
 }
 
 // write out an image and perhaps tell the user you're doing so
-void WriteImageVerb(CImage& img, const char* filename, int verbose) {
+void WriteImageVerb(const CImage& img, const char* filename, int verbose) {
 	if (verbose)
 		fprintf(stderr, "Writing image %s\n", filename);
 	WriteImage(img, filename);
 }
+
+void WriteImageVerb(const CImage& img, const char* filename, int verbose,
+                    const CPngOptions& png) {
+	if (verbose)
+		fprintf(stderr, "Writing image %s\n", filename);
+	WriteImage(img, filename, png);
+}
@@ -31,8 +31,78 @@
 //
 ///////////////////////////////////////////////////////////////////////////
 
+// PNG encoding options:  the zlib level and strategy and the row filter
+// trade file size for speed.  The presets, fastest first:
+//  ePngFastest     -- no compression (zlib level 0, no row filter)
+//  ePngFast        -- zlib level 1, Z_RLE, "Up" row filter
+//  ePngDefault     -- the libpng defaults (level 6, adaptive row filters)
+//  ePngSmallest    -- zlib level 9, adaptive row filters
+// See README.txt for the speed and size on the example flow.
+//
+// With nThreads != 1, WriteImage cuts large images into strips of rows
+// and deflates them in parallel (pigz style) into one zlib stream.  The
+// file differs from the single-threaded one but is about the same size,
+// and decodes to the same pixels with any png reader.
+
+enum EPngPreset { ePngFastest, ePngFast, ePngDefault, ePngSmallest };
+
+enum EPngStrategy           // zlib deflate strategy
+{
+    ePngStrategyDefault,    // Z_DEFAULT_STRATEGY (libpng uses Z_FILTERED with row filters)
+    ePngStrategyFiltered,   // Z_FILTERED
+    ePngStrategyHuffman,    // Z_HUFFMAN_ONLY
+    ePngStrategyRLE         // Z_RLE
+};
+
+enum EPngFilter             // PNG row filter
+{
+    ePngFilterAdaptive = -1,    // libpng picks one per row
+    ePngFilterNone, ePngFilterSub, ePngFilterUp, ePngFilterAvg, ePngFilterPaeth
+};
+
+struct CPngOptions
+{
+    int level;              // zlib level 0 (none) .. 9 (smallest), -1 = libpng default
+    EPngStrategy strategy;
+    EPngFilter filter;
+    int nThreads;           // encoding threads (0 = ThreadCount(), default 1);
+                            // CPngRowWriter always uses one
+
+    CPngOptions(EPngPreset preset = ePngDefault);
+    static CPngOptions FromName(const char* name);  // preset name or zlib level 0..9
+};
+
 void ReadImage (CImage& img, const char* filename);
-void WriteImage(CImage& img, const char* filename);
+void WriteImage(const CImage& img, const char* filename);
+void WriteImage(const CImage& img, const char* filename, const CPngOptions& png);
 
 void ReadImageVerb (CImage& img, const char* filename, int verbose);
-void WriteImageVerb(CImage& img, const char* filename, int verbose);
+void WriteImageVerb(const CImage& img, const char* filename, int verbose);
+void WriteImageVerb(const CImage& img, const char* filename, int verbose,
+                    const CPngOptions& png);
+
+// The PNG reader and writer keep no global state and may be called from
+// several threads at once (on different images).
+
+// Incremental PNG writer (implemented in ImageIOpng.cpp):  rows are handed
+// to libpng as soon as they are produced, so that images which do not fit
+// into memory can be written band by band.  Rows are 8-bit BGR(A) or gray.
+// Each writer has its own libpng state, so several can run in parallel.
+
+struct CPngState;           // libpng structures, file and error message
+
+class CPngRowWriter
+{
+public:
+    CPngRowWriter(void);
+    ~CPngRowWriter(void);   // abandons the file if Close() was not called
+    void Open(const char* filename, int width, int height, int nBands,
+              const CPngOptions& png = CPngOptions());
+    void WriteRows(const CByteImage& band, int nRows);  // first nRows rows of band
+    void Close(void);       // write the remaining chunks and close the file
+private:
+    void Abandon(void);     // release libpng state and the file
+    CPngState* m_state;     // NULL if not open
+    int m_width, m_height, m_nBands;
+    int m_row;              // number of rows written so far
+};
@@ -7,6 +7,16 @@
 //  This file is based pmon lpng\contrib\visupng\PngFile.c by Willem van Schaik
 //  It requires the libpng and zlib libraries.
 //
+//  All libpng state lives in a CPngState owned by the call (or by the
+//  CPngRowWriter), so several threads can read and write png files at
+//  the same time.  libpng is C code, so its errors are not thrown through
+//  it:  pngfile_error records the message and longjmps back to the setjmp
+//  in our function that called libpng, which then throws a CError.  That
+//  function declares all its C++ objects before the setjmp.
+//
+//  With CPngOptions::nThreads != 1, WriteFilePNG deflates strips of rows
+//  in parallel and writes the png chunks itself (see WriteFilePNGStrips).
+//
 // SEE ALSO
 //  ImageIO.cpp
 //
@@ -21,15 +31,74 @@ extern "C"{
 
 #include "Image.h"
 #include "Error.h"
+#include "ImageIO.h"
+#include "Parallel.h"
 #include <vector>
+#include <setjmp.h>
+#include <zlib.h>
+
+// libpng structures, file and error message of one read or write
+struct CPngState
+{
+	png_structp png;
+	png_infop info;
+	FILE *stream;
+	bool writing;
+	char message[256];	// set by pngfile_error
+
+	CPngState(FILE *s, bool w) : png(NULL), info(NULL), stream(s), writing(w)
+	{
+		message[0] = 0;
+	}
+	~CPngState()
+	{
+		if (png) {
+			if (writing)
+				png_destroy_write_struct(&png, info ? &info : (png_infopp) NULL);
+			else
+				png_destroy_read_struct(&png, info ? &info : (png_infopp) NULL, NULL);
+		}
+		if (stream)
+			fclose(stream);
+	}
+};
 
-// global variables pointing to the png stuctures
-static png_structp png_ptr = NULL;
-static png_infop info_ptr = NULL;
+static void pngfile_error(png_structp png_ptr, png_const_charp msg)
+{
+	CPngState *state = (CPngState *) png_get_error_ptr(png_ptr);
+	snprintf(state->message, sizeof(state->message), "%s", msg);
+	png_longjmp(png_ptr, 1);
+}
 
-static void pngfile_error(png_structp /*png_ptr*/, png_const_charp msg)
+// create the two png(-info) structures, with errors reported to state
+static bool CreatePngStructs(CPngState& state)
 {
-	throw CError(msg);
+	if (state.writing)
+		state.png = png_create_write_struct(PNG_LIBPNG_VER_STRING, &state,
+			pngfile_error, NULL);
+	else
+		state.png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &state,
+			pngfile_error, NULL);
+	if (state.png)
+		state.info = png_create_info_struct(state.png);
+	return state.png && state.info;
+}
+
+// zlib strategies and libpng filter flags of EPngStrategy and EPngFilter
+static const int pngStrategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE };
+static const int pngFilters[] = { PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+	PNG_FILTER_AVG, PNG_FILTER_PAETH };
+
+// apply the encoding options (before png_write_info); the defaults leave
+// libpng alone, so the output does not change
+static void SetPngOptions(png_structp png_ptr, const CPngOptions& opts)
+{
+	if (opts.level >= 0)
+		png_set_compression_level(png_ptr, opts.level);
+	if (opts.strategy != ePngStrategyDefault)
+		png_set_compression_strategy(png_ptr, pngStrategies[opts.strategy]);
+	if (opts.filter != ePngFilterAdaptive)
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, pngFilters[opts.filter]);
 }
 
 #define DEBUG_ImageIOpng 0
@@ -38,7 +107,7 @@ static void pngfile_error(png_structp /*png_ptr*/, png_const_charp msg)
 // Make sure the image has the smallest number of bands before writing.
 // That is, if it's 4 bands with full alpha, reduce to 3 bands.  
 // If it's 3 bands with constant colors, make it 1-band.
-CByteImage removeRedundantBands(CByteImage img)
+CByteImage removeRedundantBands(const CByteImage& img)
 {
     CShape sh = img.Shape();
 	int w = sh.width, h = sh.height, nB = sh.nBands;
@@ -50,7 +119,7 @@ CByteImage removeRedundantBands(CByteImage img)
 	bool fullAlpha = true;
 	if (nB == 4) {
 		for (y = 0; y < h && fullAlpha; y++) {
-			uchar *pix = &img.Pixel(0, y, 0);
+			const uchar *pix = &img.Pixel(0, y, 0);
 			for (x = 0; x < w; x++) {
 				if (pix[3] != 255) {
 					fullAlpha = false;
@@ -66,7 +135,7 @@ CByteImage removeRedundantBands(CByteImage img)
 	// check for equal colors
 	bool equalColors = true;
 	for (y = 0; y < h && equalColors; y++) {
-		uchar *pix = &img.Pixel(0, y, 0);
+		const uchar *pix = &img.Pixel(0, y, 0);
 		for (x = 0; x < w; x++) {
 			if (pix[0] != pix[1] ||
 				pix[0] != pix[2] ||
@@ -91,7 +160,7 @@ CByteImage removeRedundantBands(CByteImage img)
 	CByteImage img2(sh2);
 	
 	for (y = 0; y < h; y++) {
-		uchar *pix = &img.Pixel(0, y, 0);
+		const uchar *pix = &img.Pixel(0, y, 0);
 		uchar *pix2 = &img2.Pixel(0, y, 0);
 		for (x = 0; x < w; x++) {
 			for (int b = 0; b < newNB; b++) {
@@ -113,30 +182,23 @@ void ReadFilePNG(CByteImage& img, const char* filename)
     if (stream == 0)
         throw CError("ReadFilePNG: could not open %s", filename);
 
+    CPngState state(stream, false);	// closes the file when done
+    std::vector<uchar *> rowPtrs;
+
     // first check the eight byte PNG signature
     png_byte pbSig[8];
-    fread(pbSig, 1, 8, stream);
-	if (!png_check_sig(pbSig, 8)) {
-        fclose(stream);
+    if (fread(pbSig, 1, 8, stream) != 8 || !png_check_sig(pbSig, 8))
         throw CError("ReadFilePNG: invalid PNG signature");
-	}
 
     // create the two png(-info) structures
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
-      (png_error_ptr)pngfile_error, (png_error_ptr)NULL);
-
-	if (!png_ptr) {
-        fclose(stream);
+	if (!CreatePngStructs(state))
 		throw CError("ReadFilePNG: error creating png structure");
-	}
+	png_structp png_ptr = state.png;
+	png_infop info_ptr = state.info;
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr)
-	{
-		png_destroy_read_struct(&png_ptr, NULL, NULL);
-        fclose(stream);
-		throw CError("ReadFilePNG: error creating png structure");
-	}
+	// libpng errors come back here
+	if (setjmp(png_jmpbuf(png_ptr)))
+		throw CError("ReadFilePNG: %s", state.message);
 
 	png_init_io(png_ptr, stream);
 	png_set_sig_bytes(png_ptr, 8);
@@ -229,10 +291,8 @@ void ReadFilePNG(CByteImage& img, const char* filename)
 		nBands);
 	
 
-	if (! (nBands==1 || nBands==3 || nBands==4)) {
-        fclose(stream);
+	if (! (nBands==1 || nBands==3 || nBands==4))
 		throw CError("ReadFilePNG: Can't handle nBands=%d", nBands);
-	}
 
 	// Set the image shape
 	CShape sh(width, height, nBands);
@@ -240,8 +300,7 @@ void ReadFilePNG(CByteImage& img, const char* filename)
 	// Allocate the image if necessary
 	img.ReAllocate(sh);
 
-	//  allocate a vector of row pointers
-	std::vector<uchar *> rowPtrs;
+	//  fill the vector of row pointers
 	rowPtrs.resize(height);
 	for (int y = 0; y<height; y++)
 		rowPtrs[y] = &img.Pixel(0, y, 0);
@@ -251,16 +310,339 @@ void ReadFilePNG(CByteImage& img, const char* filename)
 
  	// read the additional chunks in the PNG file (not really needed)
 	png_read_end(png_ptr, NULL);
+}
+
+
+//
+// Parallel encoding:  the rows are cut into strips, and each strip is
+// filtered and deflated on its own thread into a raw deflate stream that
+// ends on a byte boundary (Z_SYNC_FLUSH, the last one Z_FINISH).  Like
+// pigz, each stream is primed with the last 32K of filtered data before
+// it, so matches can reach back across the strip boundary.  Concatenated
+// behind one zlib header, the streams form a single valid zlib stream;
+// its adler32 trailer is combined from those of the strips.  Each strip
+// is written as one IDAT chunk.
+//
+
+#define PNG_STRIP_MIN_BYTES (1 << 18)	// smaller strips are not worth a thread
+#define PNG_WINDOW (1 << 15)			// deflate window, and dictionary size
+
+static int PngStripCount(const CShape& sh, const CPngOptions& opts)
+{
+	double rawBytes = (double) sh.height * (sh.width * sh.nBands + 1);
+	int nStrips = ParallelBandCount(sh.height, opts.nThreads);
+	return __max(1, __min(nStrips, (int) (rawBytes / PNG_STRIP_MIN_BYTES)));
+}
+
+static inline int PaethPredictor(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+// filters the rows of an image one by one, in png byte order (RGB)
+class CPngRowFilter
+{
+public:
+	CPngRowFilter(const CByteImage& img, EPngFilter filter, int y) :
+		m_img(img), m_filter(filter), m_y(y)
+	{
+		CShape sh = img.Shape();
+		m_nBands = sh.nBands;
+		m_n = sh.width * sh.nBands;
+		m_row.resize(m_n);
+		m_prev.assign(m_n, 0);
+		for (int t = 0; t < 5; t++)
+			m_out[t].resize(m_n + 1);
+		if (y > 0)
+			ToRGB(y - 1, &m_prev[0]);
+	}
+
+	int Length() const { return m_n + 1; }
+
+	// the next row:  its filter type, then the filtered bytes
+	const uchar *Next()
+	{
+		ToRGB(m_y++, &m_row[0]);
+		int best = m_filter;
+		if (m_filter == ePngFilterAdaptive) {
+			// libpng's heuristic:  smallest sum of |signed byte|
+			long bestCost = -1;
+			for (int t = 0; t < 5; t++) {
+				Filter(t);
+				long cost = 0;
+				const uchar *f = &m_out[t][1];
+				for (int i = 0; i < m_n; i++)
+					cost += (f[i] < 128) ? f[i] : 256 - f[i];
+				if (bestCost < 0 || cost < bestCost) {
+					bestCost = cost;
+					best = t;
+				}
+			}
+		} else
+			Filter(best);
+		m_row.swap(m_prev);
+		return &m_out[best][0];
+	}
+
+private:
+	void ToRGB(int y, uchar *dst)
+	{
+		const uchar *src = &m_img.Pixel(0, y, 0);
+		if (m_nBands < 3) {
+			memcpy(dst, src, m_n);
+			return;
+		}
+		for (int i = 0; i < m_n; i += m_nBands) {
+			dst[i] = src[i + 2];
+			dst[i + 1] = src[i + 1];
+			dst[i + 2] = src[i];
+			if (m_nBands == 4)
+				dst[i + 3] = src[i + 3];
+		}
+	}
+
+	void Filter(int type)
+	{
+		const uchar *r = &m_row[0], *p = &m_prev[0];
+		uchar *f = &m_out[type][0];
+		int bpp = m_nBands, i;
+		*f++ = (uchar) type;
+		switch (type) {
+		case ePngFilterNone:
+			memcpy(f, r, m_n);
+			break;
+		case ePngFilterSub:
+			for (i = 0; i < bpp; i++)
+				f[i] = r[i];
+			for (; i < m_n; i++)
+				f[i] = (uchar) (r[i] - r[i - bpp]);
+			break;
+		case ePngFilterUp:
+			for (i = 0; i < m_n; i++)
+				f[i] = (uchar) (r[i] - p[i]);
+			break;
+		case ePngFilterAvg:
+			for (i = 0; i < bpp; i++)
+				f[i] = (uchar) (r[i] - p[i] / 2);
+			for (; i < m_n; i++)
+				f[i] = (uchar) (r[i] - (r[i - bpp] + p[i]) / 2);
+			break;
+		default:	// Paeth
+			for (i = 0; i < bpp; i++)
+				f[i] = (uchar) (r[i] - p[i]);
+			for (; i < m_n; i++)
+				f[i] = (uchar) (r[i] - PaethPredictor(r[i - bpp], p[i], p[i - bpp]));
+			break;
+		}
+	}
+
+	const CByteImage& m_img;
+	int m_filter;
+	int m_y;					// next row
+	int m_nBands, m_n;			// bytes per pixel and per row
+	std::vector<uchar> m_row, m_prev;	// RGB rows
+	std::vector<uchar> m_out[5];		// the row with each filter
+};
+
+// a raw deflate stream into a growing buffer
+class CPngDeflater
+{
+public:
+	CPngDeflater(int level, int strategy)
+	{
+		memset(&m_zs, 0, sizeof(m_zs));
+		if (deflateInit2(&m_zs, level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+			throw CError("WriteFilePNG: %s", "cannot initialize zlib");
+	}
+	~CPngDeflater() { deflateEnd(&m_zs); }
+
+	void SetDictionary(const uchar *dict, size_t n)
+	{
+		deflateSetDictionary(&m_zs, dict, (uInt) n);
+	}
+
+	// compress n bytes (flush = Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH)
+	void Deflate(const uchar *data, size_t n, int flush, std::vector<uchar>& out, size_t& used)
+	{
+		m_zs.next_in = (Bytef *) data;
+		m_zs.avail_in = (uInt) n;
+		int err;
+		do {
+			if (used == out.size())
+				out.resize(2 * out.size() + 4096);
+			m_zs.next_out = &out[used];
+			m_zs.avail_out = (uInt) (out.size() - used);
+			err = deflate(&m_zs, flush);
+			used = out.size() - m_zs.avail_out;
+			if (err == Z_STREAM_ERROR)
+				throw CError("WriteFilePNG: %s", "zlib error");
+		} while (m_zs.avail_out == 0 || (flush == Z_FINISH && err != Z_STREAM_END));
+	}
+
+private:
+	z_stream m_zs;
+};
+
+struct CPngStrip
+{
+	std::vector<uchar> data;	// IDAT data (the first strip starts with the zlib header)
+	uLong adler;				// adler32 of the filtered rows
+	uLong rawLength;			// number of filtered bytes
+	uLong crc;					// crc32 of "IDAT" and data
+};
+
+static int PngZLevel(const CPngOptions& opts)
+{
+	return (opts.level >= 0) ? opts.level : Z_DEFAULT_COMPRESSION;
+}
 
-	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+static int PngZStrategy(const CPngOptions& opts)
+{
+	// libpng's default is Z_FILTERED for filtered rows
+	if (opts.strategy == ePngStrategyDefault)
+		return (opts.filter == ePngFilterNone) ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	return pngStrategies[opts.strategy];
+}
+
+static void EncodePngStrip(const CByteImage& img, int s, int nStrips,
+						   const CPngOptions& opts, CPngStrip& strip)
+{
+	CShape sh = img.Shape();
+	int lo = (int) ((double) sh.height * s / nStrips);
+	int hi = (int) ((double) sh.height * (s + 1) / nStrips);
+	int level = PngZLevel(opts), strategy = PngZStrategy(opts);
+	CPngDeflater deflater(level, strategy);
+	std::vector<uchar>& out = strip.data;
+	size_t used = 0;
+	out.resize(deflateBound(NULL, (uLong) (hi - lo) * (sh.width * sh.nBands + 1)) + 64);
+
+	if (s == 0) {
+		// zlib header:  deflate with a 32K window, and the level
+		int flevel = (strategy >= Z_HUFFMAN_ONLY || (level >= 0 && level < 2)) ? 0 :
+			(level >= 0 && level < 6) ? 1 : (level < 0 || level == 6) ? 2 : 3;
+		int cmf = 0x78, flg = flevel << 6;
+		flg += 31 - (cmf * 256 + flg) % 31;
+		out[used++] = (uchar) cmf;
+		out[used++] = (uchar) flg;
+	}
+
+	// prime the stream with the (filtered) data just before the strip
+	CPngRowFilter filter(img, opts.filter, lo - __min(lo, PNG_WINDOW / (sh.width * sh.nBands + 1) + 1));
+	int rowLength = filter.Length();
+	if (lo > 0) {
+		std::vector<uchar> dict;
+		for (int y = lo - __min(lo, PNG_WINDOW / rowLength + 1); y < lo; y++) {
+			const uchar *row = filter.Next();
+			dict.insert(dict.end(), row, row + rowLength);
+		}
+		size_t n = __min(dict.size(), (size_t) PNG_WINDOW);
+		deflater.SetDictionary(&dict[dict.size() - n], n);
+	}
+
+	strip.adler = adler32(0L, Z_NULL, 0);
+	for (int y = lo; y < hi; y++) {
+		const uchar *row = filter.Next();
+		strip.adler = adler32(strip.adler, row, rowLength);
+		deflater.Deflate(row, rowLength, Z_NO_FLUSH, out, used);
+	}
+	deflater.Deflate(NULL, 0, (s == nStrips - 1) ? Z_FINISH : Z_SYNC_FLUSH, out, used);
+	out.resize(used);
+	strip.rawLength = (uLong) (hi - lo) * rowLength;
+	strip.crc = crc32(crc32(0L, (const Bytef *) "IDAT", 4), &out[0], (uInt) used);
+}
+
+static void PutU32(uchar *p, uLong v)
+{
+	// big-endian, as in all png integers
+	p[0] = (uchar) (v >> 24);
+	p[1] = (uchar) (v >> 16);
+	p[2] = (uchar) (v >> 8);
+	p[3] = (uchar) v;
+}
+
+static void WriteBytes(FILE *stream, const void *data, size_t n, const char *filename)
+{
+	if (n > 0 && fwrite(data, 1, n, stream) != n)
+		throw CError("WriteFilePNG: could not write %s", filename);
+}
+
+static void WritePngChunk(FILE *stream, const char *type, const uchar *data, size_t n,
+						  const char *filename)
+{
+	uchar head[8], tail[4];
+	PutU32(head, (uLong) n);
+	memcpy(head + 4, type, 4);
+	uLong crc = crc32(0L, (const Bytef *) type, 4);
+	if (n > 0)		// crc32 of NULL is the initial value
+		crc = crc32(crc, data, (uInt) n);
+	PutU32(tail, crc);
+	WriteBytes(stream, head, 8, filename);
+	WriteBytes(stream, data, n, filename);
+	WriteBytes(stream, tail, 4, filename);
+}
+
+static void WriteFilePNGStrips(const CByteImage& img, const char* filename,
+							   const CPngOptions& opts, int nStrips)
+{
+	CShape sh = img.Shape();
+
+	// filter and deflate the strips in parallel
+	std::vector<CPngStrip> strips(nStrips);
+	ParallelForBands(0, nStrips, nStrips, [&](int lo, int hi) {
+		for (int s = lo; s < hi; s++)
+			EncodePngStrip(img, s, nStrips, opts, strips[s]);
+	});
+
+	// adler32 of the whole stream, for the zlib trailer
+	uLong adler = strips[0].adler;
+	for (int s = 1; s < nStrips; s++)
+		adler = adler32_combine(adler, strips[s].adler, (z_off_t) strips[s].rawLength);
+	uchar trailer[4];
+	PutU32(trailer, adler);
+
+	FILE *stream = fopen(filename, "wb");
+	if (stream == 0)
+		throw CError("WriteFilePNG: could not open %s", filename);
+	CPngState state(stream, true);	// closes the file when done
+
+	static const uchar signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	WriteBytes(stream, signature, 8, filename);
+
+	uchar ihdr[13];
+	PutU32(ihdr, sh.width);
+	PutU32(ihdr + 4, sh.height);
+	ihdr[8] = 8;	// bits
+	ihdr[9] = (sh.nBands == 1) ? PNG_COLOR_TYPE_GRAY :
+			  (sh.nBands == 3) ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+	ihdr[10] = PNG_COMPRESSION_TYPE_DEFAULT;
+	ihdr[11] = PNG_FILTER_TYPE_DEFAULT;
+	ihdr[12] = PNG_INTERLACE_NONE;
+	WritePngChunk(stream, "IHDR", ihdr, 13, filename);
+
+	// one IDAT per strip, the last one followed by the trailer
+	for (int s = 0; s < nStrips; s++) {
+		const CPngStrip& strip = strips[s];
+		bool last = (s == nStrips - 1);
+		uchar head[8], tail[4];
+		PutU32(head, (uLong) (strip.data.size() + (last ? 4 : 0)));
+		memcpy(head + 4, "IDAT", 4);
+		PutU32(tail, last ? crc32(strip.crc, trailer, 4) : strip.crc);
+		WriteBytes(stream, head, 8, filename);
+		WriteBytes(stream, &strip.data[0], strip.data.size(), filename);
+		if (last)
+			WriteBytes(stream, trailer, 4, filename);
+		WriteBytes(stream, tail, 4, filename);
+	}
 
-	fclose(stream);
+	WritePngChunk(stream, "IEND", NULL, 0, filename);
 }
 
 
-void WriteFilePNG(CByteImage img, const char* filename)
+void WriteFilePNG(const CByteImage& src, const char* filename, const CPngOptions& opts)
 {
-	img = removeRedundantBands(img);
+	CByteImage img = removeRedundantBands(src);
 
     CShape sh = img.Shape();
     int width = sh.width, height = sh.height, nBands = sh.nBands;
@@ -269,23 +651,27 @@ void WriteFilePNG(CByteImage img, const char* filename)
 	// That is, if it's 4 bands with full alpha, reduce to 3 bands.  
 	// If it's 3 bands with constant colors, make it 1-band.
 
+	// deflate strips of rows in parallel if there are several threads
+	int nStrips = PngStripCount(sh, opts);
+	if (nStrips > 1) {
+		WriteFilePNGStrips(img, filename, opts, nStrips);
+		return;
+	}
+
     FILE *stream = fopen(filename, "wb");
     if (stream == 0)
         throw CError("WriteFilePNG: could not open %s", filename);
+    CPngState state(stream, true);	// closes the file when done
+    std::vector<uchar *> rowPtrs;
 
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
-      (png_error_ptr)pngfile_error, (png_error_ptr)NULL);
-
-	if (!png_ptr) {
-        fclose(stream);
+	if (!CreatePngStructs(state))
 		throw CError("WriteFilePNG: error creating png structure");
-	}
+	png_structp png_ptr = state.png;
+	png_infop info_ptr = state.info;
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        fclose(stream);
-		throw CError("WriteFilePNG: error creating png structure");
-    }
+	// libpng errors come back here
+	if (setjmp(png_jmpbuf(png_ptr)))
+		throw CError("WriteFilePNG: %s", state.message);
 
 	png_init_io(png_ptr, stream);
 
@@ -299,6 +685,7 @@ void WriteFilePNG(CByteImage img, const char* filename)
 		PNG_INTERLACE_NONE, 
 		PNG_COMPRESSION_TYPE_DEFAULT, 
 		PNG_FILTER_TYPE_DEFAULT);
+	SetPngOptions(png_ptr, opts);
 
 	// write the file header information
 	png_write_info(png_ptr, info_ptr);
@@ -306,19 +693,129 @@ void WriteFilePNG(CByteImage img, const char* filename)
 	// swap the BGR pixels in the DiData structure to RGB
 	png_set_bgr(png_ptr);
 
-	//  allocate a vector of row pointers
-	std::vector<uchar *> rowPtrs;
+	//  fill the vector of row pointers
 	rowPtrs.resize(height);
 	for (int y = 0; y<height; y++)
-		rowPtrs[y] = &img.Pixel(0, y, 0);
+		rowPtrs[y] = (uchar *) &img.Pixel(0, y, 0);  // only read by libpng
 
 	// write the whole image
 	png_write_image(png_ptr, &rowPtrs[0]);
 
 	// write the additional chunks to the PNG file (not really needed)
 	png_write_end(png_ptr, info_ptr);
+}
+
+
+//
+// class CPngRowWriter: incremental PNG writer
+//
+
+CPngRowWriter::CPngRowWriter()
+{
+	m_state = NULL;
+	m_width = m_height = m_nBands = m_row = 0;
+}
+
+CPngRowWriter::~CPngRowWriter()
+{
+	Abandon();
+}
+
+void CPngRowWriter::Abandon()
+{
+	delete m_state;		// releases the png structures and closes the file
+	m_state = NULL;
+}
+
+// Each member function that calls libpng sets its own error return point;
+// after an error the writer is abandoned
+
+void CPngRowWriter::Open(const char* filename, int width, int height, int nBands,
+						 const CPngOptions& opts)
+{
+	Abandon();
+	if (! (nBands==1 || nBands==3 || nBands==4))
+		throw CError("WriteFilePNG: Can't handle nBands=%d", nBands);
+
+	FILE *stream = fopen(filename, "wb");
+	if (stream == 0)
+		throw CError("WriteFilePNG: could not open %s", filename);
+	m_state = new CPngState(stream, true);
+	if (!CreatePngStructs(*m_state)) {
+		Abandon();
+		throw CError("WriteFilePNG: error creating png structure");
+	}
+	png_structp png = m_state->png;
+	png_infop info = m_state->info;
+
+	if (setjmp(png_jmpbuf(png))) {
+		CError err("WriteFilePNG: %s", m_state->message);
+		Abandon();
+		throw err;
+	}
+
+	png_init_io(png, stream);
+
+	int bits = 8;
+	int colortype =
+		nBands == 1 ? PNG_COLOR_TYPE_GRAY :
+		nBands == 3 ? PNG_COLOR_TYPE_RGB :
+	                  PNG_COLOR_TYPE_RGB_ALPHA;
+	png_set_IHDR(png, info, width, height,
+		bits, colortype,
+		PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT);
+	SetPngOptions(png, opts);
+
+	// write the file header information
+	png_write_info(png, info);
+
+	// swap the BGR pixels to RGB
+	png_set_bgr(png);
+
+	m_width = width;
+	m_height = height;
+	m_nBands = nBands;
+	m_row = 0;
+}
+
+void CPngRowWriter::WriteRows(const CByteImage& band, int nRows)
+{
+	CShape sh = band.Shape();
+	if (m_state == NULL)
+		throw CError("WriteFilePNG: writer is not open");
+	if (sh.width != m_width || sh.nBands != m_nBands || nRows > sh.height)
+		throw CError("WriteFilePNG: band does not match the image shape");
+	if (m_row + nRows > m_height)
+		throw CError("WriteFilePNG: too many rows (%d)", m_row + nRows);
+
+	png_structp png = m_state->png;
+	if (setjmp(png_jmpbuf(png))) {
+		CError err("WriteFilePNG: %s", m_state->message);
+		Abandon();
+		throw err;
+	}
+	for (int y = 0; y < nRows; y++)
+		png_write_row(png, (png_bytep) &band.Pixel(0, y, 0));
+	m_row += nRows;
+}
 
-	png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
+void CPngRowWriter::Close()
+{
+	if (m_state == NULL)
+		return;
+	if (m_row != m_height)
+		throw CError("WriteFilePNG: only %d rows were written", m_row);
+
+	if (setjmp(png_jmpbuf(m_state->png))) {
+		CError err("WriteFilePNG: %s", m_state->message);
+		Abandon();
+		throw err;
+	}
+
+	// write the additional chunks to the PNG file (not really needed)
+	png_write_end(m_state->png, m_state->info);
 
-    fclose (stream);
+	Abandon();
 }
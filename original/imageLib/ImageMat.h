@@ -0,0 +1,129 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  ImageMat.h -- share pixels between CImageOf<T> and OpenCV's cv::Mat
+//
+// SPECIFICATION
+//  template <class T>
+//  void WrapMat(const cv::Mat& mat, CImageOf<T>& img);
+//
+//  template <class T>
+//  cv::Mat WrapImage(const CImageOf<T>& img);
+//
+// DESCRIPTION
+//  WrapMat makes img an image that uses the pixels of mat, with mat's
+//  row step; WrapImage returns a cv::Mat header on the pixels of img.
+//  Nothing is copied, and writes through either object show up in the
+//  other one, as with two CImages that share memory.
+//
+//  The memory stays alive as long as either side uses it: the CImage
+//  memory control block holds a reference to the cv::Mat (released by
+//  its delete function), and the cv::Mat holds a CImage copy (released
+//  by a cv::MatAllocator when the last cv::Mat header goes away).
+//
+//  Both libraries store color pixels in B, G, R(, A) order, so 3- and
+//  4-band images can go straight to and from the OpenCV codecs.  The
+//  pixel type must match the cv::Mat depth (uchar = CV_8U, int = CV_32S,
+//  float = CV_32F), and the cv::Mat must be 2-dimensional.
+//
+//  This header is not part of imageLib.h, so that imageLib itself does
+//  not depend on OpenCV; include it after imageLib.h.
+//
+// SEE ALSO
+//  Image.h             image class definition
+//
+// See Copyright.h for more details
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef IMAGE_MAT_H
+#define IMAGE_MAT_H
+
+#include <opencv2/core.hpp>
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag CvAccessFlag;
+#else
+typedef int CvAccessFlag;
+#endif
+
+// Releases the pixels of a cv::Mat made by WrapImage; other cv::Mats
+// (e.g., after create() with a new size) use the standard allocator
+
+class CImageMatAllocator : public cv::MatAllocator
+{
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                           size_t* step, CvAccessFlag flags,
+                           cv::UMatUsageFlags usageFlags) const
+    {
+        return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data,
+                                                    step, flags, usageFlags);
+    }
+    bool allocate(cv::UMatData* u, CvAccessFlag flags,
+                  cv::UMatUsageFlags usageFlags) const
+    {
+        return cv::Mat::getStdAllocator()->allocate(u, flags, usageFlags);
+    }
+    void deallocate(cv::UMatData* u) const
+    {
+        // drop the reference to the image memory
+        delete (CImage *) u->userdata;
+        delete u;
+    }
+
+    static CImageMatAllocator* Instance()
+    {
+        static CImageMatAllocator allocator;
+        return &allocator;
+    }
+};
+
+inline void ReleaseWrappedMat(void *mat)
+{
+    // CRefCntMem delete function for the memory of WrapMat
+    delete (cv::Mat *) mat;
+}
+
+template <class T>
+inline void WrapMat(const cv::Mat& mat, CImageOf<T>& img)
+{
+    if (mat.empty())
+    {
+        img.ReAllocate(CShape(), false);
+        return;
+    }
+    if (mat.dims != 2)
+        throw CError("WrapMat: cannot wrap a %d-dimensional cv::Mat", mat.dims);
+    if (mat.depth() != cv::DataType<T>::depth)
+        throw CError("WrapMat: cv::Mat depth %d does not match the pixel type", mat.depth());
+    img.ReAllocate(CShape(mat.cols, mat.rows, mat.channels()), (T *) mat.data,
+                   true, (ptrdiff_t) mat.step[0],
+                   ReleaseWrappedMat, new cv::Mat(mat));
+}
+
+template <class T>
+inline cv::Mat WrapImage(const CImageOf<T>& img)
+{
+    CShape sh = img.Shape();
+    if (sh.width == 0 || sh.height == 0 || sh.nBands == 0)
+        return cv::Mat();
+    const uchar *data = (const uchar *) &img.Pixel(0, 0, 0);
+    size_t step = (sh.height > 1) ?
+        (const uchar *) &img.Pixel(0, 1, 0) - data : sizeof(T) * sh.width * sh.nBands;
+    cv::Mat mat(sh.height, sh.width, CV_MAKETYPE(cv::DataType<T>::depth, sh.nBands),
+                (void *) data, step);
+
+    // tie the lifetime of the pixels to the cv::Mat reference count
+    CImageMatAllocator *allocator = CImageMatAllocator::Instance();
+    cv::UMatData *u = new cv::UMatData(allocator);
+    u->data = u->origdata = mat.data;
+    u->size = step * sh.height;
+    u->refcount = 1;
+    u->userdata = new CImage(img);
+    mat.u = u;
+    mat.allocator = allocator;
+    return mat;
+}
+
+#endif // IMAGE_MAT_H
@@ -0,0 +1,232 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Parallel.cpp -- split loops over image rows across a thread pool
+//
+// DESCRIPTION
+//  The pool keeps ThreadCount() - 1 worker threads waiting on a
+//  condition variable.  A job is a task plus a number of chunks; the
+//  workers and the calling thread claim chunk indices under the pool
+//  mutex until none are left, and the caller waits until the last
+//  claimed chunk has finished.  Chunks are coarse (a few per thread),
+//  so the locking is not a bottleneck.
+//
+//  The pool only grows: a job says how many workers may join it, and
+//  the others keep waiting, so that calls with different thread counts
+//  do not restart threads.
+//
+// SEE ALSO
+//  Parallel.h          description of the interface
+//
+// See Copyright.h for more details
+//
+///////////////////////////////////////////////////////////////////////////
+
+#include "Parallel.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <atomic>
+#include <vector>
+
+// chunks per thread: a little slack for load balancing
+#define CHUNKS_PER_THREAD 4
+
+class CThreadPool
+{
+public:
+    CThreadPool() : m_task(0), m_nChunks(0), m_next(0), m_finished(0),
+                    m_maxActive(0), m_active(0), m_quit(false) {}
+    ~CThreadPool()                      { Stop(); }
+
+    void Reserve(int nWorkers);         // start workers until there are nWorkers
+    void Run(int nChunks, int nWorkers, const std::function<void (int)>& task);
+
+private:
+    void WorkerLoop();
+    void RunChunks(std::unique_lock<std::mutex>& lock);
+    void Stop();
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;                 // guards everything below
+    std::condition_variable m_wake;     // a job was posted (or quit)
+    std::condition_variable m_done;     // the last chunk finished
+    const std::function<void (int)>* m_task;
+    int m_nChunks;                      // chunks in the current job
+    int m_next;                         // next chunk to claim
+    int m_finished;                     // chunks completed
+    int m_maxActive;                    // workers allowed to join the job
+    int m_active;                       // workers that have joined it
+    bool m_quit;
+    std::exception_ptr m_error;         // first exception thrown by a chunk
+    std::mutex m_runMutex;              // one job at a time
+};
+
+// set in pool workers and in a thread that is running a job,
+// so that nested calls run serially instead of deadlocking
+static thread_local bool insideParallel = false;
+
+void CThreadPool::Reserve(int nWorkers)
+{
+    std::lock_guard<std::mutex> run(m_runMutex);
+    while ((int) m_workers.size() < nWorkers)
+        m_workers.push_back(std::thread(&CThreadPool::WorkerLoop, this));
+}
+
+void CThreadPool::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    for (size_t i = 0; i < m_workers.size(); i++)
+        m_workers[i].join();
+    m_workers.clear();
+}
+
+void CThreadPool::RunChunks(std::unique_lock<std::mutex>& lock)
+{
+    // claim and run chunks until none are left; called with the lock held
+    while (m_next < m_nChunks) {
+        int i = m_next++;
+        const std::function<void (int)>& task = *m_task;
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            task(i);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+        if (error && !m_error)
+            m_error = error;
+        if (++m_finished == m_nChunks)
+            m_done.notify_all();
+    }
+}
+
+void CThreadPool::WorkerLoop()
+{
+    insideParallel = true;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_wake.wait(lock, [this] {
+            return m_quit || (m_next < m_nChunks && m_active < m_maxActive); });
+        if (m_quit)
+            return;
+        m_active++;
+        RunChunks(lock);
+        m_active--;
+    }
+}
+
+void CThreadPool::Run(int nChunks, int nWorkers, const std::function<void (int)>& task)
+{
+    std::lock_guard<std::mutex> run(m_runMutex);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_task = &task;
+    m_nChunks = nChunks;
+    m_next = m_finished = 0;
+    m_maxActive = nWorkers;
+    m_error = std::exception_ptr();
+    lock.unlock();
+    m_wake.notify_all();
+
+    // the calling thread works on the job, too
+    lock.lock();
+    insideParallel = true;
+    RunChunks(lock);
+    insideParallel = false;
+    m_done.wait(lock, [this] { return m_finished == m_nChunks; });
+    m_nChunks = m_next = m_finished = m_maxActive = 0;
+    m_task = 0;
+    std::exception_ptr error = m_error;
+    m_error = std::exception_ptr();
+    lock.unlock();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+static std::atomic<int> threadCount(1);
+
+static CThreadPool& Pool()
+{
+    static CThreadPool pool;
+    return pool;
+}
+
+void SetThreadCount(int nThreads)
+{
+    if (nThreads <= 0)
+        nThreads = (int) std::thread::hardware_concurrency();
+    threadCount = nThreads > 1 ? nThreads : 1;
+}
+
+int ThreadCount()
+{
+    return threadCount;
+}
+
+int ParallelChunkCount(int n)
+{
+    int nThreads = threadCount;         // read once, SetThreadCount may race
+    int nChunks = nThreads > 1 ? nThreads * CHUNKS_PER_THREAD : 1;
+    return n < nChunks ? (n > 0 ? n : 0) : nChunks;
+}
+
+// run body on nChunks chunks of [begin, end) with up to nThreads threads
+static void RunJob(int begin, int end, int nChunks, int nThreads,
+                   const std::function<void (int chunk, int lo, int hi)>& body)
+{
+    int n = end - begin;
+    if (nChunks == 0)
+        return;
+
+    // chunk i covers [begin + n*i/nChunks, begin + n*(i+1)/nChunks)
+    std::function<void (int)> task = [&](int i) {
+        int lo = begin + (int) ((long long) n * i / nChunks);
+        int hi = begin + (int) ((long long) n * (i + 1) / nChunks);
+        body(i, lo, hi);
+    };
+
+    if (nChunks == 1 || insideParallel) {
+        for (int i = 0; i < nChunks; i++)
+            task(i);
+        return;
+    }
+    CThreadPool& pool = Pool();
+    pool.Reserve(nThreads - 1);         // no-op unless more threads are wanted
+    pool.Run(nChunks, nThreads - 1, task);
+}
+
+void ParallelForChunks(int begin, int end, int nChunks,
+                       const std::function<void (int chunk, int lo, int hi)>& body)
+{
+    if (nChunks > end - begin)
+        nChunks = end - begin > 0 ? end - begin : 0;
+    RunJob(begin, end, nChunks, threadCount, body);
+}
+
+int ParallelBandCount(int n, int nThreads)
+{
+    if (nThreads <= 0)
+        nThreads = threadCount;
+    return n < nThreads ? (n > 0 ? n : 0) : nThreads;
+}
+
+void ParallelForBands(int begin, int end, int nThreads,
+                      const std::function<void (int lo, int hi)>& body)
+{
+    int nBands = ParallelBandCount(end - begin, nThreads);
+    RunJob(begin, end, nBands, nBands,
+           [&](int, int lo, int hi) { body(lo, hi); });
+}
+
+void ParallelFor(int begin, int end, const std::function<void (int lo, int hi)>& body)
+{
+    ParallelForChunks(begin, end, ParallelChunkCount(end - begin),
+                      [&](int, int lo, int hi) { body(lo, hi); });
+}
@@ -0,0 +1,62 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// NAME
+//  Parallel.h -- split loops over image rows across a thread pool
+//
+// DESCRIPTION
+//  ParallelFor(begin, end, body) cuts the range [begin, end) into
+//  contiguous chunks and calls body(lo, hi) on each chunk, using a
+//  lazily created pool of worker threads plus the calling thread.
+//  The call returns when all chunks are done.  The first exception
+//  thrown by a chunk is re-thrown in the calling thread.
+//
+//  The number of threads is a global setting:
+//      SetThreadCount(1);  // default: run everything in the calling thread
+//      SetThreadCount(0);  // one thread per hardware core
+//      SetThreadCount(8);  // the caller plus 7 workers
+//
+//  Chunks are fixed for a given range and thread count, so reductions
+//  that keep one partial result per chunk and combine them in chunk
+//  order are deterministic.  Calls to ParallelFor from inside a chunk
+//  run serially in that thread.
+//
+//  ParallelForBands is for loops with a setup cost per chunk (e.g., a
+//  row window that has to be primed): it makes exactly one band per
+//  thread, and the thread count can be given per call.
+//
+// SEE ALSO
+//  Parallel.cpp        implementation
+//
+// See Copyright.h for more details
+//
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <functional>
+
+void SetThreadCount(int nThreads);  // 0 = number of hardware cores
+int ThreadCount();                  // current setting (>= 1)
+
+// number of chunks ParallelFor will use for a range of n items
+int ParallelChunkCount(int n);
+
+// call body(lo, hi) on chunks of [begin, end)
+void ParallelFor(int begin, int end, const std::function<void (int lo, int hi)>& body);
+
+// same, on exactly nChunks chunks (at most end - begin), with the chunk
+// index 0 .. nChunks - 1 passed along, for per-chunk partial results;
+// get nChunks once from ParallelChunkCount and size the results with it
+void ParallelForChunks(int begin, int end, int nChunks,
+                       const std::function<void (int chunk, int lo, int hi)>& body);
+
+// number of bands ParallelForBands will use for a range of n items
+int ParallelBandCount(int n, int nThreads);
+
+// call body(lo, hi) on one contiguous band of [begin, end) per thread,
+// using nThreads threads (0 = ThreadCount())
+void ParallelForBands(int begin, int end, int nThreads,
+                      const std::function<void (int lo, int hi)>& body);
+
+#endif // PARALLEL_H
@@ -13,6 +13,53 @@
 
 #include "RefCntMem.h"
 
+//
+// Spare control blocks: each thread keeps a few released CRefCntMemPtr
+// objects for reuse, so that an image whose pixels come from the buffer
+// pool (see Image.cpp) can be allocated without touching the heap
+//
+
+#define SPARE_PTR_MAX 32
+
+struct CSparePtrs           // trivially destructible, so it outlives the cleanup
+{
+    CRefCntMemPtr *ptr[SPARE_PTR_MAX];
+    int n;                  // -1 once the thread's cleanup has run
+};
+static thread_local CSparePtrs sparePtrs;
+
+struct CSparePtrsCleanup    // frees the spare blocks when the thread exits
+{
+    bool armed;
+    CSparePtrsCleanup() : armed(false) {}
+    ~CSparePtrsCleanup()
+    {
+        for (int i = 0; i < sparePtrs.n; i++)
+            delete sparePtrs.ptr[i];
+        sparePtrs.n = -1;   // static objects released later use the heap
+    }
+};
+static thread_local CSparePtrsCleanup sparePtrsCleanup;
+
+static CRefCntMemPtr *NewPtr()
+{
+    if (sparePtrs.n > 0)
+        return sparePtrs.ptr[--sparePtrs.n];
+    return new CRefCntMemPtr;
+}
+
+static void DeletePtr(CRefCntMemPtr *ptr)
+{
+    if (sparePtrs.n >= 0 && sparePtrs.n < SPARE_PTR_MAX)
+    {
+        if (sparePtrs.n == 0)
+            sparePtrsCleanup.armed = true;  // constructs it in this thread
+        sparePtrs.ptr[sparePtrs.n++] = ptr;
+    }
+    else
+        delete ptr;
+}
+
 CRefCntMem::CRefCntMem()
 {
     // Default constructor
@@ -31,17 +78,23 @@ void CRefCntMem::DecrementCount()
     // Decrement the reference count and delete if done
     if (m_ptr)
     {
-        m_ptr->m_refCnt -= 1;
-        if (m_ptr->m_refCnt == 0)
+        // release: our writes to the memory happen before its deletion;
+        // acquire (below): so do the writes of all other owners.
+        // A count of 1 means we are the only owner and nobody else can
+        // add a reference, so the read-modify-write can be skipped
+        if (m_ptr->m_refCnt.load(std::memory_order_acquire) == 1 ||
+            m_ptr->m_refCnt.fetch_sub(1, std::memory_order_release) == 1)
         {
+            std::atomic_thread_fence(std::memory_order_acquire);
             if (m_ptr->m_deleteWhenDone)
             {
                 if (m_ptr->m_delFn)
-                    m_ptr->m_delFn(m_ptr->m_memory);
+                    m_ptr->m_delFn(m_ptr->m_delArg ? m_ptr->m_delArg :
+                                   m_ptr->m_memory);
                 else
                     delete (double *) m_ptr->m_memory;
             }
-            delete m_ptr;
+            DeletePtr(m_ptr);
         }
     }
 }
@@ -51,7 +104,8 @@ void CRefCntMem::IncrementCount()
     // Increment the reference count
     if (m_ptr)
     {
-        m_ptr->m_refCnt += 1;
+        // the caller already holds a reference, so no ordering is needed
+        m_ptr->m_refCnt.fetch_add(1, std::memory_order_relaxed);
     }
 }
 
@@ -62,46 +116,69 @@ CRefCntMem::CRefCntMem(const CRefCntMem& ref)
     (*this) = ref;      // use assignment operator
 }
 
+CRefCntMem::CRefCntMem(CRefCntMem&& ref)
+{
+    // Move constructor: take over the reference of ref
+    m_ptr = ref.m_ptr;
+    ref.m_ptr = 0;
+}
+
 CRefCntMem& CRefCntMem::operator=(const CRefCntMem& ref)
 {
     // Assignment
+    if (m_ptr == ref.m_ptr)
+        return *this;   // also covers self-assignment
     DecrementCount();   // if m_ptr exists, no longer pointing to it
     m_ptr = ref.m_ptr;
     IncrementCount();
     return *this;
 }
 
-void CRefCntMem::ReAllocate(int nBytes, void *memory, bool deleteWhenDone,
-                            void (*deleteFunction)(void *ptr))
+CRefCntMem& CRefCntMem::operator=(CRefCntMem&& ref)
+{
+    // Move assignment: drop our reference and take over the one of ref
+    if (this != &ref)
+    {
+        DecrementCount();
+        m_ptr = ref.m_ptr;
+        ref.m_ptr = 0;
+    }
+    return *this;
+}
+
+void CRefCntMem::ReAllocate(size_t nBytes, void *memory, bool deleteWhenDone,
+                            void (*deleteFunction)(void *ptr),
+                            void *deleteArg)
 {
     // Allocate/deallocate memory
     DecrementCount();
     if (memory)
     {
-        m_ptr = new CRefCntMemPtr;
+        m_ptr = NewPtr();
         m_ptr->m_nBytes = nBytes;
         m_ptr->m_memory = memory;
         m_ptr->m_deleteWhenDone = deleteWhenDone;
         m_ptr->m_refCnt = 1;
         m_ptr->m_delFn = deleteFunction;
+        m_ptr->m_delArg = deleteArg;
     }
     else
         m_ptr = 0;  // don't bother storing pointer to null memory
 }
 
-int CRefCntMem::NBytes()
+size_t CRefCntMem::NBytes() const
 {
     // Number of stored bytes
     return (m_ptr) ? m_ptr->m_nBytes : 0;
 }
 
-bool CRefCntMem::InBounds(int index)
+bool CRefCntMem::InBounds(size_t index) const
 {
     // Check if index is in bounds
-    return (m_ptr && 0 <= index && index < m_ptr->m_nBytes);
+    return (m_ptr && index < m_ptr->m_nBytes);
 }
 
-void* CRefCntMem::Memory()
+void* CRefCntMem::Memory() const
 {
     // Pointer to allocated memory
     return (m_ptr) ? m_ptr->m_memory : 0;
@@ -13,6 +13,12 @@
 //  the including class to achieve a similar kind of memory sharing as
 //  is found in garbage collected languages such as Java and C#.
 //
+//  The reference count is atomic, so copies of the same memory may be
+//  created and destroyed concurrently in different threads (as with
+//  std::shared_ptr, a single CRefCntMem object must not be modified
+//  by two threads at once).  Access to the memory itself is not
+//  synchronized.
+//
 // SEE ALSO
 //  RefCntMem.cpp       implementation
 //  Image.h             class that uses a CRefCntMem object
@@ -22,13 +28,17 @@
 //
 ///////////////////////////////////////////////////////////////////////////
 
+#include <stddef.h>
+#include <atomic>
+
 struct CRefCntMemPtr         // shared component of reference counted memory
 {
     void *m_memory;         // allocated memory
-    int m_refCnt;           // reference count
-    int m_nBytes;           // number of bytes
+    std::atomic<int> m_refCnt;  // reference count
+    size_t m_nBytes;        // number of bytes
     bool m_deleteWhenDone;  // delete memory when ref-count drops to 0
     void (*m_delFn)(void *ptr); // optional delete function
+    void *m_delArg;         // argument for m_delFn (m_memory if 0)
 };
 
 class CRefCntMem            // reference-counted memory allocator
@@ -36,15 +46,18 @@ class CRefCntMem            // reference-counted memory allocator
 public:
     CRefCntMem(void);           // default constructor
     CRefCntMem(const CRefCntMem& ref);  // copy constructor
+    CRefCntMem(CRefCntMem&& ref);       // move constructor (no count update)
     ~CRefCntMem(void);          // destructor
     CRefCntMem& operator=(const CRefCntMem& ref);  // assignment
+    CRefCntMem& operator=(CRefCntMem&& ref);       // move assignment
 
-    void ReAllocate(int nBytes, void *memory, bool deleteWhenDone,
-                    void (*deleteFunction)(void *ptr) = 0);
+    void ReAllocate(size_t nBytes, void *memory, bool deleteWhenDone,
+                    void (*deleteFunction)(void *ptr) = 0,
+                    void *deleteArg = 0);
         // allocate/deallocate memory
-    int NBytes(void);           // number of stored bytes
-    bool InBounds(int i);       // check if index is in bounds
-    void* Memory(void);         // pointer to allocated memory
+    size_t NBytes(void) const;  // number of stored bytes
+    bool InBounds(size_t i) const;  // check if index is in bounds
+    void* Memory(void) const;   // pointer to allocated memory
 private:
     void DecrementCount(void);  // decrement the reference count and delete if done
     void IncrementCount(void);  // increment the reference count
@@ -6,3 +6,4 @@
 #include "Image.h"
 #include "ImageIO.h"
 #include "Convert.h"
+#include "Parallel.h"